@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include "crawler.h"
+
+// Crawls a synthetic link graph served from memory, so the crawler can be
+// measured without the network. Page i is named "p<i>" and always links
+// to page i+1, so the whole graph is reachable from p0. Out-degrees follow
+// a Pareto distribution and link targets are skewed towards low page
+// numbers, like on the web where a few pages collect most of the links.
+
+#define MAX_LIST 16
+
+struct graph {
+  int pages;
+  char **content;
+  int *sizes;
+  int max_size;
+  unsigned long edges;
+  unsigned long edge_sum;
+};
+
+struct graph graph;
+unsigned long latency_us;
+unsigned long jitter_us;
+unsigned long edges_seen;
+unsigned long edge_sum_seen;
+unsigned long page_queue_bytes;
+int zero_copy;
+
+void *Malloc(size_t size) {
+  void *r = malloc(size);
+  assert(r);
+  return r;
+}
+
+// xorshift64*, seeded per page so the graph does not depend on the order
+// pages are generated in.
+unsigned long next_random(unsigned long *state) {
+  unsigned long x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DUL;
+}
+
+double next_uniform(unsigned long *state) {
+  return ((next_random(state) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+// Edges are checked by the sum of their hashes, which does not depend on
+// the order they are reported in but changes if one is missing, reported
+// twice or has the wrong end.
+unsigned long edge_hash(int from, int to) {
+  unsigned long x = ((unsigned long)from << 32 | (unsigned)to) + 0x9E3779B97F4A7C15UL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9UL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBUL;
+  return x ^ (x >> 31);
+}
+
+void graph_init(int pages, double mean_degree, double alpha, int page_size) {
+  // Pareto with scale xm has mean alpha * xm / (alpha - 1).
+  double xm = mean_degree * (alpha - 1) / alpha;
+  const char *filler = "lorem ipsum dolor sit amet consectetur adipiscing elit ";
+  int filler_len = strlen(filler);
+  graph.pages = pages;
+  graph.content = Malloc(pages * sizeof(char *));
+  graph.sizes = Malloc(pages * sizeof(int));
+  graph.edges = 0;
+  graph.edge_sum = 0;
+  graph.max_size = 0;
+  int i;
+  for (i = 0; i < pages; i++) {
+    unsigned long state = 0x9E3779B97F4A7C15UL * (i + 1);
+    double degree = xm * pow(next_uniform(&state), -1.0 / alpha);
+    int links = (int)degree;
+    if (links > pages)
+      links = pages;
+    int capacity = page_size + (links + 1) * 24;
+    char *buf = Malloc(capacity + 1);
+    int len = 0;
+    int j;
+    for (j = 0; j <= links; j++) {
+      int to;
+      if (j == 0)
+        to = (i + 1) % pages;
+      else
+        to = (int)(pages * pow(next_uniform(&state), 2.0));
+      len += sprintf(buf + len, "link:p%d\n", to);
+      graph.edges++;
+      graph.edge_sum += edge_hash(i, to);
+    }
+    while (len < page_size) {
+      int n = page_size - len < filler_len ? page_size - len : filler_len;
+      memcpy(buf + len, filler, n);
+      len += n;
+    }
+    buf[len] = '\0';
+    graph.content[i] = buf;
+    graph.sizes[i] = len;
+    if (len > graph.max_size)
+      graph.max_size = len;
+  }
+}
+
+int fetch_index(char *link) {
+  int i = atoi(link + 1);
+  assert(link[0] == 'p' && i >= 0 && i < graph.pages);
+  if (latency_us > 0 || jitter_us > 0) {
+    unsigned long delay = latency_us;
+    if (jitter_us > 0)
+      delay += (i * 2654435761UL) % jitter_us;
+    usleep(delay);
+  }
+  return i;
+}
+
+char *fetch(char *link) {
+  int i = fetch_index(link);
+  char *buf = Malloc(graph.sizes[i] + 1);
+  memcpy(buf, graph.content[i], graph.sizes[i] + 1);
+  return buf;
+}
+
+// Hands out the generated page itself; it outlives the crawl, so there is
+// nothing to release.
+void fetch_buffer(char *link, struct crawl_buffer *buf) {
+  int i = fetch_index(link);
+  buf->data = graph.content[i];
+  buf->len = graph.sizes[i];
+}
+
+void edge(char *from, char *to) {
+  __atomic_add_fetch(&edges_seen, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&edge_sum_seen, edge_hash(atoi(from + 1), atoi(to + 1)), __ATOMIC_RELAXED);
+}
+
+double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int parse_list(char *arg, int *list) {
+  int n = 0;
+  char *tok = strtok(arg, ",");
+  while (tok != NULL && n < MAX_LIST) {
+    list[n++] = atoi(tok);
+    assert(list[n - 1] > 0);
+    tok = strtok(NULL, ",");
+  }
+  return n;
+}
+
+// Runs one crawl of the whole graph and returns pages per second. With a
+// byte budget it also checks that the fetched pages never held more than
+// the budget, or than one page if a page is larger than the budget.
+double run(int download_workers, int parse_workers, int queue_size, int pool_workers) {
+  struct crawl_options options;
+  memset(&options, 0, sizeof(options));
+  options.download_workers = download_workers;
+  options.parse_workers = parse_workers;
+  options.queue_size = queue_size;
+  options.pool_workers = pool_workers;
+  options.fetch_fn = fetch;
+  if (zero_copy)
+    options.fetch_buffer_fn = fetch_buffer;
+  options.edge_fn = edge;
+  struct crawl_stats stats;
+  if (page_queue_bytes > 0 && pool_workers == 0) {
+    options.page_queue_bytes = page_queue_bytes;
+    options.stats = &stats;
+  }
+  edges_seen = 0;
+  edge_sum_seen = 0;
+  double start = seconds();
+  int rc = crawl_with_options("p0", &options);
+  double elapsed = seconds() - start;
+  assert(rc == 0);
+  assert(edges_seen == graph.edges);
+  assert(edge_sum_seen == graph.edge_sum);
+  if (options.stats != NULL) {
+    unsigned long limit = page_queue_bytes;
+    if (limit < (unsigned long)graph.max_size)
+      limit = graph.max_size;
+    assert(stats.page_queue_bytes_high_water > 0);
+    assert(stats.page_queue_bytes_high_water <= limit);
+    crawl_stats_destroy(&stats);
+  }
+  return graph.pages / elapsed;
+}
+
+void usage(char *prog) {
+  fprintf(stderr, "usage: %s [-n pages] [-d mean_degree] [-a alpha] [-s page_size]\n"
+          "          [-l latency_us] [-j jitter_us] [-w workers,...] [-q queue_sizes,...]\n"
+          "          [-p parse_workers] [-b page_queue_bytes] [-r repeats] [-z]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int pages = 20000;
+  double mean_degree = 8;
+  double alpha = 2;
+  int page_size = 1024;
+  int workers[MAX_LIST] = {1, 2, 4, 8, 16};
+  int worker_count = 5;
+  int queues[MAX_LIST] = {1, 16, 256};
+  int queue_count = 3;
+  int parse_workers = 0;
+  int repeats = 1;
+  int c;
+  while ((c = getopt(argc, argv, "n:d:a:s:l:j:w:q:p:b:r:z")) != -1) {
+    switch (c) {
+    case 'n': pages = atoi(optarg); break;
+    case 'd': mean_degree = atof(optarg); break;
+    case 'a': alpha = atof(optarg); break;
+    case 's': page_size = atoi(optarg); break;
+    case 'l': latency_us = atol(optarg); break;
+    case 'j': jitter_us = atol(optarg); break;
+    case 'w': worker_count = parse_list(optarg, workers); break;
+    case 'q': queue_count = parse_list(optarg, queues); break;
+    case 'p': parse_workers = atoi(optarg); break;
+    case 'b': page_queue_bytes = atol(optarg); break;
+    case 'r': repeats = atoi(optarg); break;
+    case 'z': zero_copy = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (pages <= 0 || mean_degree < 1 || alpha <= 1 || page_size < 0 || repeats <= 0
+      || worker_count == 0 || queue_count == 0)
+    usage(argv[0]);
+
+  graph_init(pages, mean_degree, alpha, page_size);
+  printf("# %d pages, %lu links, %d byte pages, latency %lu+%lu us%s\n",
+         pages, graph.edges, page_size, latency_us, jitter_us,
+         zero_copy ? ", zero-copy fetch" : "");
+  if (page_queue_bytes > 0)
+    printf("# split mode page queue budget %lu bytes\n", page_queue_bytes);
+  printf("%-8s %8s %8s %8s %12s %8s\n", "mode", "fetch", "parse", "queue", "pages/s", "scaling");
+
+  // Scaling is relative to the first worker count in the same mode and
+  // queue size. Each configuration reports the best of its repeats.
+  int q, w, r;
+  for (q = 0; q < queue_count; q++) {
+    double base = 0;
+    for (w = 0; w < worker_count; w++) {
+      int parsers = parse_workers > 0 ? parse_workers : workers[w];
+      double best = 0;
+      for (r = 0; r < repeats; r++) {
+        double rate = run(workers[w], parsers, queues[q], 0);
+        if (rate > best)
+          best = rate;
+      }
+      if (w == 0)
+        base = best;
+      printf("%-8s %8d %8d %8d %12.0f %7.2fx\n", "split", workers[w], parsers, queues[q],
+             best, best / base);
+    }
+  }
+  double base = 0;
+  for (w = 0; w < worker_count; w++) {
+    double best = 0;
+    for (r = 0; r < repeats; r++) {
+      double rate = run(0, 0, 0, workers[w]);
+      if (rate > best)
+        best = rate;
+    }
+    if (w == 0)
+      base = best;
+    printf("%-8s %8d %8s %8s %12.0f %7.2fx\n", "pool", workers[w], "-", "-", best, best / base);
+  }
+  return 0;
+}
@@ -1,7 +1,20 @@
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "crawler.h"
 
 // *************************
 //      memory routines
@@ -77,6 +90,13 @@ void cond_wait(cond_t *c, mutex_t *m) {
     assert(rc == 0);
 }
                                                                                 
+// Returns 0 if signaled and ETIMEDOUT if the absolute deadline passed.
+int cond_timedwait(cond_t *c, mutex_t *m, struct timespec *deadline) {
+    int rc = pthread_cond_timedwait(c, m, deadline);
+    assert(rc == 0 || rc == ETIMEDOUT);
+    return rc;
+}
+
 void cond_signal(cond_t *c) {
     int rc = pthread_cond_signal(c);
     assert(rc == 0);
@@ -92,6 +112,137 @@ void cond_destroy(cond_t *c) {
     assert(rc == 0);
 }
 
+// *************************
+//      slab allocator
+// *************************
+
+// Fixed-size object allocator. Each thread allocates from and frees into
+// its own slab_cache_t without locking; caches exchange objects with the
+// shared depot in batches of SLAB_BATCH. Objects are carved out of chunks
+// that are only returned to the system by slab_destroy.
+typedef struct __slab_t {
+    size_t size;
+    void *depot;
+    void *chunks;
+    mutex_t mutex;
+} slab_t;
+
+typedef struct __slab_cache_t {
+    slab_t *slab;
+    void *free;
+    size_t count;
+} slab_cache_t;
+
+const size_t SLAB_BATCH = 64;
+
+void slab_init(slab_t *s, size_t size) {
+    s->size = (size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+    s->depot = NULL;
+    s->chunks = NULL;
+    mutex_init(&s->mutex);
+}
+
+void slab_cache_init(slab_cache_t *c, slab_t *s) {
+    c->slab = s;
+    c->free = NULL;
+    c->count = 0;
+}
+
+void slab_cache_refill(slab_cache_t *c) {
+    slab_t *s = c->slab;
+    mutex_lock(&s->mutex);
+    if (s->depot == NULL) {
+        void **chunk = (void **)mem_malloc(sizeof(void *) + SLAB_BATCH * s->size);
+        *chunk = s->chunks;
+        s->chunks = (void *)chunk;
+        char *obj = (char *)(chunk + 1);
+        size_t i = 0;
+        for (; i < SLAB_BATCH; i++, obj += s->size) {
+            *(void **)obj = s->depot;
+            s->depot = (void *)obj;
+        }
+    }
+    while (s->depot != NULL && c->count < SLAB_BATCH) {
+        void *obj = s->depot;
+        s->depot = *(void **)obj;
+        *(void **)obj = c->free;
+        c->free = obj;
+        c->count++;
+    }
+    mutex_unlock(&s->mutex);
+}
+
+void slab_cache_flush(slab_cache_t *c, size_t keep) {
+    slab_t *s = c->slab;
+    mutex_lock(&s->mutex);
+    while (c->count > keep) {
+        void *obj = c->free;
+        c->free = *(void **)obj;
+        c->count--;
+        *(void **)obj = s->depot;
+        s->depot = obj;
+    }
+    mutex_unlock(&s->mutex);
+}
+
+void *slab_alloc(slab_cache_t *c) {
+    if (c->free == NULL)
+        slab_cache_refill(c);
+    void *obj = c->free;
+    c->free = *(void **)obj;
+    c->count--;
+    return obj;
+}
+
+void slab_free(slab_cache_t *c, void *obj) {
+    *(void **)obj = c->free;
+    c->free = obj;
+    c->count++;
+    if (c->count >= 2 * SLAB_BATCH)
+        slab_cache_flush(c, SLAB_BATCH);
+}
+
+void slab_destroy(slab_t *s) {
+    while (s->chunks != NULL) {
+        void *chunk = s->chunks;
+        s->chunks = *(void **)chunk;
+        mem_free(chunk);
+    }
+    mutex_destroy(&s->mutex);
+}
+
+// *************************
+//      refcounted strings
+// *************************
+
+// A URL is allocated once by the parser and then shared, not copied, by
+// the url queue, the visited set and the page that is fetched for it.
+// Callers only ever see the char * and the header sits right before it.
+typedef struct __rcstr_t {
+    size_t refs;
+    char str[];
+} rcstr_t;
+
+char *rcstr_create(char *str, size_t len) {
+    rcstr_t *r = (rcstr_t *)mem_malloc(sizeof(rcstr_t) + len + 1);
+    r->refs = 1;
+    memcpy(r->str, str, len);
+    r->str[len] = '\0';
+    return r->str;
+}
+
+char *rcstr_retain(char *str) {
+    rcstr_t *r = (rcstr_t *)(str - offsetof(rcstr_t, str));
+    __sync_add_and_fetch(&r->refs, 1);
+    return str;
+}
+
+void rcstr_release(char *str) {
+    rcstr_t *r = (rcstr_t *)(str - offsetof(rcstr_t, str));
+    if (__sync_sub_and_fetch(&r->refs, 1) == 0)
+        mem_free(r);
+}
+
 // *************************
 //      bounded buffer
 // *************************
@@ -106,8 +257,7 @@ typedef struct __bounded_buffer_t {
     cond_t empty;
     cond_t fill;
     int done;
-    size_t workers;
-    mutex_t worker_mutex;
+    size_t high_water;
 } bounded_buffer_t;
 
 void bounded_buffer_init(bounded_buffer_t *b, size_t size) {
@@ -120,8 +270,7 @@ void bounded_buffer_init(bounded_buffer_t *b, size_t size) {
     cond_init(&b->empty);
     cond_init(&b->fill);
     b->done = 0;
-    b->workers = 0;
-    mutex_init(&b->worker_mutex);
+    b->high_water = 0;
 }
 
 void bounded_buffer_put(bounded_buffer_t *b, void* ptr) {
@@ -131,6 +280,8 @@ void bounded_buffer_put(bounded_buffer_t *b, void* ptr) {
     b->buffer[b->tail] = ptr;
     b->tail = (b->tail + 1) % b->size;
     b->count++;
+    if (b->count > b->high_water)
+        __atomic_store_n(&b->high_water, b->count, __ATOMIC_RELAXED);
     cond_signal(&b->fill);
     mutex_unlock(&b->mutex);
 }
@@ -144,9 +295,6 @@ void *bounded_buffer_get(bounded_buffer_t *b) {
         }
         cond_wait(&b->fill, &b->mutex);
     }
-    mutex_lock(&b->worker_mutex);
-    b->workers++;
-    mutex_unlock(&b->worker_mutex);
     void *ptr = b->buffer[b->head];
     b->buffer[b->head] = NULL;
     b->head = (b->head + 1) % b->size;
@@ -164,9 +312,11 @@ void bounded_buffer_destroy(bounded_buffer_t *b) {
 }
 
 void bounded_buffer_done(bounded_buffer_t *b) {
-    mutex_lock(&b->worker_mutex);
-    b->workers--;
-    mutex_unlock(&b->worker_mutex);
+    mutex_lock(&b->mutex);
+    b->done = 1;
+    cond_broadcast(&b->empty);
+    cond_broadcast(&b->fill);
+    mutex_unlock(&b->mutex);
 }
 
 // *************************
@@ -187,12 +337,11 @@ typedef struct __unbounded_buffer_t {
     mutex_t tail_mutex;
     cond_t fill;
     int done;
-    size_t workers;
-    mutex_t worker_mutex;
+    size_t high_water;
 } unbounded_buffer_t;
 
-void unbounded_buffer_init(unbounded_buffer_t *b) {
-    node_t *node = (node_t *)mem_malloc(sizeof(node_t));
+void unbounded_buffer_init(unbounded_buffer_t *b, slab_cache_t *nodes) {
+    node_t *node = (node_t *)slab_alloc(nodes);
     node->ptr = NULL;
     node->next = NULL;
     b->head = node;
@@ -203,12 +352,11 @@ void unbounded_buffer_init(unbounded_buffer_t *b) {
     mutex_init(&b->tail_mutex);
     cond_init(&b->fill);
     b->done = 0;
-    b->workers = 0;
-    mutex_init(&b->worker_mutex);
+    b->high_water = 0;
 }
 
-void unbounded_buffer_put(unbounded_buffer_t *b, void *ptr) {
-    node_t *node = (node_t *)mem_malloc(sizeof(node_t));
+void unbounded_buffer_put(unbounded_buffer_t *b, void *ptr, slab_cache_t *nodes) {
+    node_t *node = (node_t *)slab_alloc(nodes);
     node->ptr = ptr;
     node->next = NULL;
     mutex_lock(&b->tail_mutex);
@@ -217,11 +365,13 @@ void unbounded_buffer_put(unbounded_buffer_t *b, void *ptr) {
     mutex_lock(&b->mutex);
     mutex_unlock(&b->tail_mutex);
     b->count++;
+    if (b->count > b->high_water)
+        __atomic_store_n(&b->high_water, b->count, __ATOMIC_RELAXED);
     cond_signal(&b->fill);
     mutex_unlock(&b->mutex);
 }
 
-void *unbounded_buffer_get(unbounded_buffer_t *b) {
+void *unbounded_buffer_get(unbounded_buffer_t *b, slab_cache_t *nodes) {
     mutex_lock(&b->mutex);
     while (b->count == 0) {
         if (b->done != 0) {
@@ -231,10 +381,7 @@ void *unbounded_buffer_get(unbounded_buffer_t *b) {
         cond_wait(&b->fill, &b->mutex);
     }
     b->count--;
-    mutex_lock(&b->worker_mutex);
     mutex_unlock(&b->mutex);
-    b->workers++;
-    mutex_unlock(&b->worker_mutex);
     mutex_lock(&b->head_mutex);
     node_t *old_node = b->head;
     node_t *node = old_node->next;
@@ -242,16 +389,16 @@ void *unbounded_buffer_get(unbounded_buffer_t *b) {
     node->ptr = NULL;
     b->head = node;
     mutex_unlock(&b->head_mutex);
-    mem_free(old_node);
+    slab_free(nodes, old_node);
     return ptr;
 }
 
-void unbounded_buffer_destroy(unbounded_buffer_t *b) {
+void unbounded_buffer_destroy(unbounded_buffer_t *b, slab_cache_t *nodes) {
     node_t *node = b->head;
     while (node != NULL) {
         node_t *old_node = node;
         node = old_node->next;
-        mem_free(old_node);
+        slab_free(nodes, old_node);
     }
     mutex_destroy(&b->mutex);
     mutex_destroy(&b->head_mutex);
@@ -260,246 +407,1836 @@ void unbounded_buffer_destroy(unbounded_buffer_t *b) {
 }
 
 void unbounded_buffer_done(unbounded_buffer_t *b) {
-    mutex_lock(&b->worker_mutex);
-    b->workers--;
-    mutex_unlock(&b->worker_mutex);
+    mutex_lock(&b->mutex);
+    b->done = 1;
+    cond_broadcast(&b->fill);
+    mutex_unlock(&b->mutex);
+}
+
+// *************************
+//      byte budget
+// *************************
+
+// Limits the bytes held by pages between fetch and the end of parsing.
+// Producers block while over the limit; a page larger than the whole limit
+// is only admitted once nothing else is held. Consumers must release
+// without ever waiting on a producer, or the two can deadlock. With
+// can_fail set, acquire returns 0 instead of blocking.
+typedef struct __byte_budget_t {
+    size_t bytes;
+    size_t limit;
+    mutex_t mutex;
+    cond_t release;
+    size_t high_water;
+} byte_budget_t;
+
+void byte_budget_init(byte_budget_t *b, size_t limit) {
+    b->bytes = 0;
+    b->limit = limit;
+    mutex_init(&b->mutex);
+    cond_init(&b->release);
+    b->high_water = 0;
+}
+
+int byte_budget_acquire(byte_budget_t *b, size_t bytes, int can_fail) {
+    mutex_lock(&b->mutex);
+    while (b->bytes > 0 && b->bytes + bytes > b->limit) {
+        if (can_fail != 0) {
+            mutex_unlock(&b->mutex);
+            return 0;
+        }
+        cond_wait(&b->release, &b->mutex);
+    }
+    b->bytes += bytes;
+    if (b->bytes > b->high_water)
+        __atomic_store_n(&b->high_water, b->bytes, __ATOMIC_RELAXED);
+    mutex_unlock(&b->mutex);
+    return 1;
+}
+
+void byte_budget_release(byte_budget_t *b, size_t bytes) {
+    mutex_lock(&b->mutex);
+    b->bytes -= bytes;
+    cond_broadcast(&b->release);
+    mutex_unlock(&b->mutex);
+}
+
+void byte_budget_destroy(byte_budget_t *b) {
+    mutex_destroy(&b->mutex);
+    cond_destroy(&b->release);
+}
+
+// *************************
+//      append-only file
+// *************************
+
+// Writers reserve their range with an atomic add and then pwrite into it,
+// so concurrent appends need no lock and never interleave.
+typedef struct __append_file_t {
+    int fd;
+    off_t end;
+} append_file_t;
+
+// Creates a scratch file in dir that is unlinked right away, so it
+// disappears when closed.
+void append_file_temp(append_file_t *f, char *dir) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/crawler-spill-XXXXXX", dir);
+    f->fd = mkstemp(path);
+    assert(f->fd >= 0);
+    unlink(path);
+    f->end = 0;
+}
+
+void append_file_open(append_file_t *f, char *path) {
+    f->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(f->fd >= 0);
+    f->end = 0;
+}
+
+off_t append_file_write(append_file_t *f, char *data, size_t size) {
+    off_t offset = __sync_fetch_and_add(&f->end, (off_t)size);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t rc = pwrite(f->fd, data + done, size - done, offset + done);
+        assert(rc > 0);
+        done += rc;
+    }
+    return offset;
+}
+
+char *append_file_read(append_file_t *f, off_t offset, size_t size) {
+    char *data = (char *)mem_malloc(size + 1);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t rc = pread(f->fd, data + done, size - done, offset + done);
+        assert(rc > 0);
+        done += rc;
+    }
+    data[size] = '\0';
+    return data;
+}
+
+void append_file_close(append_file_t *f) {
+    close(f->fd);
+}
+
+// *************************
+//      edge writer
+// *************************
+
+// Per-thread buffer of adjacency records for the edge file, handed to the
+// file in one append when full. A record is the source URL followed by its
+// link count and the links, each URL as a LEB128 length and its bytes.
+typedef struct __edge_buffer_t {
+    char *data;
+    size_t len;
+    size_t size;
+} edge_buffer_t;
+
+const size_t EDGE_BUFFER_SIZE = 65536;
+
+void edge_buffer_init(edge_buffer_t *b) {
+    b->data = NULL;
+    b->len = 0;
+    b->size = 0;
+}
+
+char *edge_buffer_varint(char *pos, size_t value) {
+    while (value >= 0x80) {
+        *pos++ = (char)(value | 0x80);
+        value >>= 7;
+    }
+    *pos++ = (char)value;
+    return pos;
+}
+
+void edge_buffer_flush(edge_buffer_t *b, append_file_t *f) {
+    if (b->len > 0)
+        append_file_write(f, b->data, b->len);
+    b->len = 0;
+}
+
+void edge_buffer_add(edge_buffer_t *b, append_file_t *f, char *from, char **tos, size_t n) {
+    size_t from_len = strlen(from);
+    size_t need = 20 + from_len;
+    size_t i = 0;
+    for (; i < n; i++)
+        need += 10 + strlen(tos[i]);
+    if (b->len + need > b->size) {
+        edge_buffer_flush(b, f);
+        if (need > b->size) {
+            mem_free(b->data);
+            b->size = need > EDGE_BUFFER_SIZE ? need : EDGE_BUFFER_SIZE;
+            b->data = (char *)mem_malloc(b->size);
+        }
+    }
+    char *pos = b->data + b->len;
+    pos = edge_buffer_varint(pos, from_len);
+    memcpy(pos, from, from_len);
+    pos = edge_buffer_varint(pos + from_len, n);
+    for (i = 0; i < n; i++) {
+        size_t len = strlen(tos[i]);
+        pos = edge_buffer_varint(pos, len);
+        memcpy(pos, tos[i], len);
+        pos += len;
+    }
+    b->len = pos - b->data;
+}
+
+void edge_buffer_destroy(edge_buffer_t *b) {
+    mem_free(b->data);
+}
+
+// *************************
+//      page fingerprints
+// *************************
+
+// 64-bit hash that consumes eight bytes per step.
+uint64_t hash64(char *data, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * 0xc6a4a7935bd1e995ULL);
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, data, 8);
+        w *= 0xff51afd7ed558ccdULL;
+        w ^= w >> 32;
+        h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+        data += 8;
+        len -= 8;
+    }
+    if (len > 0) {
+        uint64_t w = 0;
+        memcpy(&w, data, len);
+        w *= 0xff51afd7ed558ccdULL;
+        w ^= w >> 32;
+        h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Charikar's SimHash over whitespace-separated tokens: bodies that share
+// most of their tokens get hashes that differ in only a few bits.
+uint64_t simhash64(char *data, size_t len) {
+    int weights[64];
+    memset(weights, 0, sizeof(weights));
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (data[i] == ' ' || data[i] == '\n' || data[i] == '\t'))
+            i++;
+        size_t start = i;
+        while (i < len && data[i] != ' ' && data[i] != '\n' && data[i] != '\t')
+            i++;
+        if (i == start)
+            break;
+        uint64_t h = hash64(data + start, i - start);
+        int bit = 0;
+        for (; bit < 64; bit++)
+            weights[bit] += ((h >> bit) & 1) ? 1 : -1;
+    }
+    uint64_t hash = 0;
+    int bit = 0;
+    for (; bit < 64; bit++) {
+        if (weights[bit] > 0)
+            hash |= 1ULL << bit;
+    }
+    return hash;
+}
+
+// Set of 64-bit fingerprints, split into stripes by the top bits, each an
+// open-addressing table under its own lock. 0 marks an empty slot, so a
+// fingerprint of 0 is stored as 1.
+typedef struct __fpset_stripe_t {
+    uint64_t *keys;
+    size_t size;
+    size_t count;
+    mutex_t mutex;
+} fpset_stripe_t;
+
+typedef struct __fpset_t {
+    fpset_stripe_t stripes[64];
+} fpset_t;
+
+void fpset_init(fpset_t *f) {
+    size_t i = 0;
+    for (; i < 64; i++) {
+        f->stripes[i].size = 64;
+        f->stripes[i].count = 0;
+        f->stripes[i].keys = (uint64_t *)mem_calloc(64, sizeof(uint64_t));
+        mutex_init(&f->stripes[i].mutex);
+    }
+}
+
+void fpset_place(uint64_t *keys, size_t size, uint64_t key) {
+    size_t slot = key & (size - 1);
+    while (keys[slot] != 0)
+        slot = (slot + 1) & (size - 1);
+    keys[slot] = key;
+}
+
+// Returns 1 if key was added, 0 if it was already present.
+int fpset_insert(fpset_t *f, uint64_t key) {
+    if (key == 0)
+        key = 1;
+    fpset_stripe_t *s = &f->stripes[key >> 58];
+    mutex_lock(&s->mutex);
+    size_t slot = key & (s->size - 1);
+    while (s->keys[slot] != 0) {
+        if (s->keys[slot] == key) {
+            mutex_unlock(&s->mutex);
+            return 0;
+        }
+        slot = (slot + 1) & (s->size - 1);
+    }
+    s->keys[slot] = key;
+    s->count++;
+    if (s->count * 2 > s->size) {
+        uint64_t *keys = (uint64_t *)mem_calloc(s->size * 2, sizeof(uint64_t));
+        size_t i = 0;
+        for (; i < s->size; i++) {
+            if (s->keys[i] != 0)
+                fpset_place(keys, s->size * 2, s->keys[i]);
+        }
+        mem_free(s->keys);
+        s->keys = keys;
+        s->size *= 2;
+    }
+    mutex_unlock(&s->mutex);
+    return 1;
+}
+
+void fpset_destroy(fpset_t *f) {
+    size_t i = 0;
+    for (; i < 64; i++) {
+        mem_free(f->stripes[i].keys);
+        mutex_destroy(&f->stripes[i].mutex);
+    }
+}
+
+// Near-duplicate index for SimHash values. Every hash is filed under each
+// of its four 16-bit blocks; two hashes within SIMHASH_DISTANCE bits of
+// each other agree on at least one block, so only that bucket is scanned.
+// Lookup and insert are separate steps, so two near-duplicate pages that
+// are checked at the same moment can both get through.
+#define SIMHASH_DISTANCE 3
+
+typedef struct __simhash_node_t {
+    uint64_t hash;
+    struct __simhash_node_t *next;
+} simhash_node_t;
+
+typedef struct __simhash_index_t {
+    simhash_node_t **heads[4];
+    mutex_t mutexes[4];
+} simhash_index_t;
+
+void simhash_index_init(simhash_index_t *x) {
+    int band = 0;
+    for (; band < 4; band++) {
+        x->heads[band] = (simhash_node_t **)mem_calloc(65536, sizeof(simhash_node_t *));
+        mutex_init(&x->mutexes[band]);
+    }
+}
+
+// Returns 1 if a hash within SIMHASH_DISTANCE bits was already indexed,
+// otherwise indexes hash and returns 0.
+int simhash_index_insert(simhash_index_t *x, uint64_t hash) {
+    int band = 0;
+    for (; band < 4; band++) {
+        size_t block = (hash >> (16 * band)) & 0xffff;
+        mutex_lock(&x->mutexes[band]);
+        simhash_node_t *node = x->heads[band][block];
+        for (; node != NULL; node = node->next) {
+            if (__builtin_popcountll(node->hash ^ hash) <= SIMHASH_DISTANCE) {
+                mutex_unlock(&x->mutexes[band]);
+                return 1;
+            }
+        }
+        mutex_unlock(&x->mutexes[band]);
+    }
+    for (band = 0; band < 4; band++) {
+        size_t block = (hash >> (16 * band)) & 0xffff;
+        simhash_node_t *node = (simhash_node_t *)mem_malloc(sizeof(simhash_node_t));
+        node->hash = hash;
+        mutex_lock(&x->mutexes[band]);
+        node->next = x->heads[band][block];
+        x->heads[band][block] = node;
+        mutex_unlock(&x->mutexes[band]);
+    }
+    return 0;
+}
+
+void simhash_index_destroy(simhash_index_t *x) {
+    int band = 0;
+    for (; band < 4; band++) {
+        size_t block = 0;
+        for (; block < 65536; block++) {
+            simhash_node_t *node = x->heads[band][block];
+            while (node != NULL) {
+                simhash_node_t *old_node = node;
+                node = old_node->next;
+                mem_free(old_node);
+            }
+        }
+        mem_free(x->heads[band]);
+        mutex_destroy(&x->mutexes[band]);
+    }
+}
+
+// *************************
+//      work-stealing deque
+// *************************
+
+typedef struct __task_t {
+    int type;
+    void *ptr;
+} task_t;
+
+// The owner pushes and pops at the tail, thieves steal from the head.
+// head and tail only ever grow; slots are indexed modulo size.
+typedef struct __deque_t {
+    task_t *tasks;
+    size_t size;
+    size_t head;
+    size_t tail;
+    mutex_t mutex;
+} deque_t;
+
+void deque_init(deque_t *d, size_t size) {
+    d->tasks = (task_t *)mem_calloc(size, sizeof(task_t));
+    d->size = size;
+    d->head = 0;
+    d->tail = 0;
+    mutex_init(&d->mutex);
+}
+
+void deque_push(deque_t *d, task_t task) {
+    mutex_lock(&d->mutex);
+    if (d->tail - d->head == d->size) {
+        task_t *tasks = (task_t *)mem_calloc(d->size * 2, sizeof(task_t));
+        size_t i = d->head;
+        for (; i < d->tail; i++)
+            tasks[i % (d->size * 2)] = d->tasks[i % d->size];
+        mem_free(d->tasks);
+        d->tasks = tasks;
+        d->size *= 2;
+    }
+    d->tasks[d->tail % d->size] = task;
+    d->tail++;
+    mutex_unlock(&d->mutex);
+}
+
+int deque_pop(deque_t *d, task_t *task) {
+    mutex_lock(&d->mutex);
+    if (d->tail == d->head) {
+        mutex_unlock(&d->mutex);
+        return 0;
+    }
+    d->tail--;
+    *task = d->tasks[d->tail % d->size];
+    mutex_unlock(&d->mutex);
+    return 1;
+}
+
+int deque_steal(deque_t *d, task_t *task) {
+    mutex_lock(&d->mutex);
+    if (d->tail == d->head) {
+        mutex_unlock(&d->mutex);
+        return 0;
+    }
+    *task = d->tasks[d->head % d->size];
+    d->head++;
+    mutex_unlock(&d->mutex);
+    return 1;
+}
+
+void deque_destroy(deque_t *d) {
+    mem_free(d->tasks);
+    mutex_destroy(&d->mutex);
+}
+
+// *************************
+//      work-stealing pool
+// *************************
+
+// One deque per worker. queued counts tasks sitting in any deque and
+// sleepers counts idle workers, so pushers only touch the pool mutex when
+// someone may actually be waiting for work.
+typedef struct __pool_t {
+    deque_t *deques;
+    size_t workers;
+    size_t queued;
+    size_t high_water;
+    size_t sleepers;
+    int done;
+    mutex_t mutex;
+    cond_t fill;
+} pool_t;
+
+void pool_init(pool_t *p, size_t workers, size_t size) {
+    p->deques = (deque_t *)mem_calloc(workers, sizeof(deque_t));
+    p->workers = workers;
+    p->queued = 0;
+    p->high_water = 0;
+    p->sleepers = 0;
+    p->done = 0;
+    mutex_init(&p->mutex);
+    cond_init(&p->fill);
+    size_t i = 0;
+    for (; i < workers; i++)
+        deque_init(&p->deques[i], size);
+}
+
+void pool_push(pool_t *p, size_t worker, task_t task) {
+    deque_push(&p->deques[worker], task);
+    size_t queued = __sync_add_and_fetch(&p->queued, 1);
+    size_t high_water = __atomic_load_n(&p->high_water, __ATOMIC_RELAXED);
+    while (queued > high_water && __atomic_compare_exchange_n(&p->high_water,
+        &high_water, queued, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) == 0)
+        ;
+    if (__sync_add_and_fetch(&p->sleepers, 0) > 0) {
+        mutex_lock(&p->mutex);
+        cond_signal(&p->fill);
+        mutex_unlock(&p->mutex);
+    }
+}
+
+int pool_get(pool_t *p, size_t worker, task_t *task) {
+    while (1) {
+        if (deque_pop(&p->deques[worker], task) != 0) {
+            __sync_sub_and_fetch(&p->queued, 1);
+            return 1;
+        }
+        size_t i = 1;
+        for (; i < p->workers; i++) {
+            if (deque_steal(&p->deques[(worker + i) % p->workers], task) != 0) {
+                __sync_sub_and_fetch(&p->queued, 1);
+                return 1;
+            }
+        }
+        mutex_lock(&p->mutex);
+        __sync_add_and_fetch(&p->sleepers, 1);
+        while (__sync_add_and_fetch(&p->queued, 0) == 0 && p->done == 0)
+            cond_wait(&p->fill, &p->mutex);
+        __sync_sub_and_fetch(&p->sleepers, 1);
+        if (p->done != 0) {
+            mutex_unlock(&p->mutex);
+            return 0;
+        }
+        mutex_unlock(&p->mutex);
+    }
+}
+
+void pool_done(pool_t *p) {
+    mutex_lock(&p->mutex);
+    p->done = 1;
+    cond_broadcast(&p->fill);
+    mutex_unlock(&p->mutex);
+}
+
+void pool_destroy(pool_t *p) {
+    size_t i = 0;
+    for (; i < p->workers; i++)
+        deque_destroy(&p->deques[i]);
+    mem_free(p->deques);
+    mutex_destroy(&p->mutex);
+    cond_destroy(&p->fill);
+}
+
+// *************************
+//      work counter
+// *************************
+
+// Counts outstanding work items (queued or in progress). Producers add one
+// before handing an item off, and consumers mark one done when finished with
+// it. Only the transition to zero touches the mutex, so the waiter is woken
+// exactly once instead of after every item.
+typedef struct __work_counter_t {
+    size_t pending;
+    int zero;
+    mutex_t mutex;
+    cond_t cond;
+} work_counter_t;
+
+void work_counter_init(work_counter_t *w, size_t pending) {
+    w->pending = pending;
+    w->zero = 0;
+    mutex_init(&w->mutex);
+    cond_init(&w->cond);
+}
+
+void work_counter_add(work_counter_t *w) {
+    __sync_add_and_fetch(&w->pending, 1);
+}
+
+void work_counter_done(work_counter_t *w) {
+    if (__sync_sub_and_fetch(&w->pending, 1) == 0) {
+        mutex_lock(&w->mutex);
+        w->zero = 1;
+        cond_signal(&w->cond);
+        mutex_unlock(&w->mutex);
+    }
+}
+
+void work_counter_wait(work_counter_t *w) {
+    mutex_lock(&w->mutex);
+    while (w->zero == 0)
+        cond_wait(&w->cond, &w->mutex);
+    mutex_unlock(&w->mutex);
+}
+
+// Like work_counter_wait, but gives up after timeout_ms. Returns 1 if the
+// count reached zero, 0 on timeout.
+int work_counter_wait_timeout(work_counter_t *w, unsigned long timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    mutex_lock(&w->mutex);
+    while (w->zero == 0) {
+        if (cond_timedwait(&w->cond, &w->mutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+    int zero = w->zero;
+    mutex_unlock(&w->mutex);
+    return zero;
+}
+
+void work_counter_destroy(work_counter_t *w) {
+    mutex_destroy(&w->mutex);
+    cond_destroy(&w->cond);
+}
+
+// *************************
+//      statistics
+// *************************
+
+unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Every counter has a single writer, the thread that owns it, and is only
+// read concurrently by the progress reporter, so relaxed atomic loads and
+// stores are enough and no read-modify-write is needed.
+void stat_add(unsigned long *counter, unsigned long n) {
+    unsigned long value = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    __atomic_store_n(counter, value + n, __ATOMIC_RELAXED);
+}
+
+void stat_set(unsigned long *counter, unsigned long value) {
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+unsigned long stat_read(unsigned long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+size_t histogram_bucket(unsigned long value) {
+    if (value < 8)
+        return value;
+    int exp = 63 - __builtin_clzl(value);
+    size_t bucket = (exp - 2) * 8 + ((value >> (exp - 3)) & 7);
+    return bucket < CRAWL_HIST_BUCKETS ? bucket : CRAWL_HIST_BUCKETS - 1;
+}
+
+unsigned long histogram_bucket_value(size_t bucket) {
+    if (bucket < 8)
+        return bucket;
+    return (8UL + bucket % 8) << (bucket / 8 - 1);
+}
+
+void histogram_record(struct crawl_histogram *h, unsigned long value) {
+    if (h->count == 0 || value < h->min_ns)
+        stat_set(&h->min_ns, value);
+    if (value > h->max_ns)
+        stat_set(&h->max_ns, value);
+    stat_add(&h->buckets[histogram_bucket(value)], 1);
+    stat_add(&h->total_ns, value);
+    stat_add(&h->count, 1);
+}
+
+void histogram_merge(struct crawl_histogram *dst, struct crawl_histogram *src) {
+    unsigned long count = stat_read(&src->count);
+    if (count == 0)
+        return;
+    unsigned long min_ns = stat_read(&src->min_ns);
+    unsigned long max_ns = stat_read(&src->max_ns);
+    if (dst->count == 0 || min_ns < dst->min_ns)
+        dst->min_ns = min_ns;
+    if (max_ns > dst->max_ns)
+        dst->max_ns = max_ns;
+    dst->count += count;
+    dst->total_ns += stat_read(&src->total_ns);
+    size_t i = 0;
+    for (; i < CRAWL_HIST_BUCKETS; i++)
+        dst->buckets[i] += stat_read(&src->buckets[i]);
+}
+
+unsigned long crawl_histogram_percentile(struct crawl_histogram *h, double percentile) {
+    if (h->count == 0)
+        return 0;
+    unsigned long rank = (unsigned long)(percentile / 100.0 * h->count);
+    if (rank >= h->count)
+        rank = h->count - 1;
+    unsigned long seen = 0;
+    size_t i = 0;
+    for (; i < CRAWL_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return histogram_bucket_value(i);
+    }
+    return h->max_ns;
+}
+
+void crawl_stats_destroy(struct crawl_stats *stats) {
+    mem_free(stats->workers);
+    stats->workers = NULL;
+    stats->worker_count = 0;
+}
+
+// *************************
+//      url normalization
+// *************************
+
+int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+int url_unreserved(char c) {
+    return isalnum((unsigned char)c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+// Resolves "." and ".." segments of the len-byte path in place, as in
+// RFC 3986 section 5.2.4, and returns the new length. ".." segments that
+// would climb above the start of a relative path are kept.
+size_t remove_dot_segments(char *path, size_t len) {
+    size_t absolute = (len > 0 && path[0] == '/');
+    size_t r = absolute;
+    size_t w = absolute;
+    size_t segments = 0;
+    size_t parents = 0;
+    while (r <= len) {
+        size_t end = r;
+        while (end < len && path[end] != '/')
+            end++;
+        size_t n = end - r;
+        if (n == 1 && path[r] == '.') {
+            // skip
+        } else if (n == 2 && path[r] == '.' && path[r + 1] == '.' && segments > parents) {
+            while (w > absolute && path[w - 1] != '/')
+                w--;
+            if (w > absolute)
+                w--;
+            segments--;
+        } else if (n == 2 && path[r] == '.' && path[r + 1] == '.' && absolute != 0) {
+            // nothing above the root
+        } else {
+            if (segments > 0)
+                path[w++] = '/';
+            memmove(path + w, path + r, n);
+            w += n;
+            segments++;
+            if (n == 2 && path[r] == '.' && path[r + 1] == '.')
+                parents++;
+        }
+        r = end + 1;
+    }
+    return w;
+}
+
+// Rewrites the len-byte URL in place into a canonical form and returns
+// its new length, which is never longer:
+//  - the fragment is dropped,
+//  - percent-escapes of unreserved characters are decoded, the rest get
+//    uppercase hex digits,
+//  - the scheme and host of an absolute URL are lowercased,
+//  - "." and ".." path segments are resolved, and
+//  - a trailing slash is dropped unless the path is just "/".
+size_t normalize_url(char *url, size_t len) {
+    char *fragment = (char *)memchr(url, '#', len);
+    if (fragment != NULL)
+        len = fragment - url;
+
+    size_t r = 0;
+    size_t w = 0;
+    while (r < len) {
+        int hi, lo;
+        if (url[r] == '%' && r + 2 < len && (hi = hex_value(url[r + 1])) >= 0
+            && (lo = hex_value(url[r + 2])) >= 0) {
+            char c = (char)(hi * 16 + lo);
+            if (url_unreserved(c)) {
+                url[w++] = c;
+            } else {
+                url[w++] = '%';
+                url[w++] = toupper((unsigned char)url[r + 1]);
+                url[w++] = toupper((unsigned char)url[r + 2]);
+            }
+            r += 3;
+        } else {
+            url[w++] = url[r++];
+        }
+    }
+    len = w;
+
+    size_t path = 0;
+    size_t i = 0;
+    while (i < len && (isalnum((unsigned char)url[i]) || url[i] == '+' || url[i] == '-'
+        || url[i] == '.'))
+        i++;
+    if (i > 0 && isalpha((unsigned char)url[0]) && len - i >= 3 && memcmp(url + i, "://", 3) == 0) {
+        size_t host = i + 3;
+        path = host;
+        while (path < len && url[path] != '/' && url[path] != '?') {
+            if (url[path] == '@')
+                host = path + 1;
+            path++;
+        }
+        size_t j = 0;
+        for (; j < i; j++)
+            url[j] = tolower((unsigned char)url[j]);
+        for (j = host; j < path; j++)
+            url[j] = tolower((unsigned char)url[j]);
+    }
+    char *query = (char *)memchr(url + path, '?', len - path);
+    size_t path_end = query != NULL ? (size_t)(query - url) : len;
+    size_t path_len = remove_dot_segments(url + path, path_end - path);
+    if (path_len > 1 && url[path + path_len - 1] == '/')
+        path_len--;
+    memmove(url + path + path_len, url + path_end, len - path_end);
+    return path + path_len + (len - path_end);
+}
+
+// Creates a refcounted copy of the len-byte url, canonicalized if asked
+// to.
+char *url_create(char *url, size_t len, int normalize) {
+    char *str = rcstr_create(url, len);
+    if (normalize != 0)
+        str[normalize_url(str, len)] = '\0';
+    return str;
 }
 
 // *************************
 //      string hash set
 // *************************
 
+// Entries are never removed before hashset_destroy, so pointers to them
+// stay valid for the whole crawl. id is the string's 64-bit hash, which is
+// compared before the strings themselves. mark is free for the caller to
+// use; it is read and written with atomics, not under the bucket lock.
+// depth is left for the caller to set right after inserting.
+typedef struct __hashset_entry_t {
+    char *str;
+    uint64_t id;
+    unsigned long mark;
+    unsigned int depth;
+    struct __hashset_entry_t *next;
+} hashset_entry_t;
+
+// Bucket i is guarded by mutexes[i % locks], so there can be many more
+// buckets than locks.
 typedef struct __hashset_t {
-    node_t **heads;
+    hashset_entry_t **heads;
     mutex_t *mutexes;
     size_t buckets;
+    size_t locks;
 } hashset_t;
 
-size_t hashset_hash(char *str) {
-    size_t hash = 0;
-    char *c = str;
-    while (*c != '\0') {
-        hash = (size_t)*c + 31 * hash;
-        c++;
-    }
-    return hash;
-}
-
-void hashset_init(hashset_t *h, size_t buckets) {
-    h->heads = mem_calloc(buckets, sizeof(node_t *));
-    h->mutexes = mem_calloc(buckets, sizeof(mutex_t));
+void hashset_init(hashset_t *h, size_t buckets, size_t locks) {
+    h->heads = mem_calloc(buckets, sizeof(hashset_entry_t *));
+    h->mutexes = mem_calloc(locks, sizeof(mutex_t));
     h->buckets = buckets;
+    h->locks = locks;
     int i = 0;
-    for (; i < buckets; i++)
+    for (; i < locks; i++)
         mutex_init(&h->mutexes[i]);
 }
 
-void hashset_insert(hashset_t *h, char *str) {
-    size_t bucket = hashset_hash(str) % h->buckets;
-    mutex_lock(&h->mutexes[bucket]);
-    node_t *node = h->heads[bucket];
-    while (node != NULL) {
-        if (strcmp((char *)node->ptr, str) == 0)
+hashset_entry_t *hashset_find(hashset_t *h, size_t bucket, uint64_t id, char *str) {
+    hashset_entry_t *entry = h->heads[bucket];
+    while (entry != NULL) {
+        if (entry->id == id && strcmp(entry->str, str) == 0)
             break;
-        node = node->next;
+        entry = entry->next;
     }
-    if (node == NULL) {
-        node = (node_t *)mem_malloc(sizeof(node_t));
-        node->ptr = (void *)str_duplicate(str);
-        node->next = h->heads[bucket];
-        h->heads[bucket] = node;
+    return entry;
+}
+
+// Adds a reference to str to the set unless an equal string is already
+// there. Returns the new entry, or NULL if str was already present.
+hashset_entry_t *hashset_insert(hashset_t *h, char *str, slab_cache_t *entries) {
+    uint64_t id = hash64(str, strlen(str));
+    size_t bucket = id % h->buckets;
+    mutex_t *mutex = &h->mutexes[bucket % h->locks];
+    mutex_lock(mutex);
+    if (hashset_find(h, bucket, id, str) != NULL) {
+        mutex_unlock(mutex);
+        return NULL;
     }
-    mutex_unlock(&h->mutexes[bucket]);
+    hashset_entry_t *entry = (hashset_entry_t *)slab_alloc(entries);
+    entry->str = rcstr_retain(str);
+    entry->id = id;
+    entry->mark = 0;
+    entry->depth = 0;
+    entry->next = h->heads[bucket];
+    h->heads[bucket] = entry;
+    mutex_unlock(mutex);
+    return entry;
 }
 
 int hashset_contains(hashset_t *h, char *str) {
-    size_t bucket = hashset_hash(str) % h->buckets;
-    mutex_lock(&h->mutexes[bucket]);
-    node_t *node = h->heads[bucket];
-    while (node != NULL) {
-        if (strcmp((char *)node->ptr, str) == 0)
-            break;
-        node = node->next;
+    uint64_t id = hash64(str, strlen(str));
+    size_t bucket = id % h->buckets;
+    mutex_t *mutex = &h->mutexes[bucket % h->locks];
+    mutex_lock(mutex);
+    hashset_entry_t *entry = hashset_find(h, bucket, id, str);
+    mutex_unlock(mutex);
+    return entry != NULL;
+}
+
+// Calls fn on every entry, holding only that entry's bucket lock, so
+// inserts into other buckets proceed meanwhile.
+void hashset_foreach(hashset_t *h, void (*fn)(hashset_entry_t *entry, void *arg), void *arg) {
+    int i = 0;
+    for (; i < h->buckets; i++) {
+        mutex_t *mutex = &h->mutexes[i % h->locks];
+        mutex_lock(mutex);
+        hashset_entry_t *entry = h->heads[i];
+        for (; entry != NULL; entry = entry->next)
+            fn(entry, arg);
+        mutex_unlock(mutex);
     }
-    mutex_unlock(&h->mutexes[bucket]);
-    return node != NULL;
 }
 
-void hashset_destroy(hashset_t *h) {
+void hashset_destroy(hashset_t *h, slab_cache_t *entries) {
     int i = 0;
     for (; i < h->buckets; i++) {
-        node_t *node = h->heads[i];
-        while (node != NULL) {
-            node_t *old_node = node;
-            node = old_node->next;
-            mem_free(old_node->ptr);
-            mem_free(old_node);
+        hashset_entry_t *entry = h->heads[i];
+        while (entry != NULL) {
+            hashset_entry_t *old_entry = entry;
+            entry = old_entry->next;
+            rcstr_release(old_entry->str);
+            slab_free(entries, old_entry);
         }
-        mutex_destroy(&h->mutexes[i]);
     }
+    for (i = 0; i < h->locks; i++)
+        mutex_destroy(&h->mutexes[i]);
     mem_free(h->heads);
     mem_free(h->mutexes);
 }
 
+// *************************
+//      checkpoint file
+// *************************
+
+// Layout, all integers little-endian as written by the host:
+//   char magic[8] = CHECKPOINT_MAGIC
+//   uint64_t done_count, pending_count
+//   done_count + pending_count records of uint32_t length + bytes
+// Done URLs have been fetched and parsed; pending URLs still have to be.
+#define CHECKPOINT_MAGIC "CRAWLCP1"
+
+typedef struct __strvec_t {
+    char **items;
+    size_t count;
+    size_t size;
+} strvec_t;
+
+void strvec_init(strvec_t *v) {
+    v->size = 64;
+    v->count = 0;
+    v->items = (char **)mem_calloc(v->size, sizeof(char *));
+}
+
+void strvec_push(strvec_t *v, char *str) {
+    if (v->count == v->size) {
+        v->size *= 2;
+        v->items = (char **)realloc(v->items, v->size * sizeof(char *));
+        assert(v->items != NULL);
+    }
+    v->items[v->count++] = str;
+}
+
+void strvec_destroy(strvec_t *v) {
+    mem_free(v->items);
+}
+
+size_t checkpoint_records_size(strvec_t *v) {
+    size_t size = 0;
+    size_t i = 0;
+    for (; i < v->count; i++)
+        size += sizeof(uint32_t) + strlen(v->items[i]);
+    return size;
+}
+
+char *checkpoint_put_records(char *pos, strvec_t *v) {
+    size_t i = 0;
+    for (; i < v->count; i++) {
+        uint32_t len = strlen(v->items[i]);
+        memcpy(pos, &len, sizeof(len));
+        memcpy(pos + sizeof(len), v->items[i], len);
+        pos += sizeof(len) + len;
+    }
+    return pos;
+}
+
+// Writes a new checkpoint next to path through a shared mapping, then
+// renames it over path, so a crash never leaves a torn checkpoint behind.
+void checkpoint_write(char *path, strvec_t *done, strvec_t *pending) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    size_t size = 8 + 2 * sizeof(uint64_t) +
+        checkpoint_records_size(done) + checkpoint_records_size(pending);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    int rc = ftruncate(fd, size);
+    assert(rc == 0);
+    char *map = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(map != MAP_FAILED);
+    uint64_t counts[2] = {done->count, pending->count};
+    memcpy(map, CHECKPOINT_MAGIC, 8);
+    memcpy(map + 8, counts, sizeof(counts));
+    char *pos = checkpoint_put_records(map + 8 + sizeof(counts), done);
+    pos = checkpoint_put_records(pos, pending);
+    assert(pos == map + size);
+    rc = msync(map, size, MS_SYNC);
+    assert(rc == 0);
+    munmap(map, size);
+    fsync(fd);
+    close(fd);
+    rc = rename(tmp_path, path);
+    assert(rc == 0);
+}
+
+typedef struct __checkpoint_t {
+    char *map;
+    size_t size;
+    uint64_t done_count;
+    uint64_t pending_count;
+    char *records;
+} checkpoint_t;
+
+// Maps an existing checkpoint read-only. Returns 0 if it cannot be opened
+// or is not a checkpoint.
+int checkpoint_open(checkpoint_t *c, char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < 8 + 2 * (off_t)sizeof(uint64_t)) {
+        close(fd);
+        return 0;
+    }
+    c->map = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (c->map == MAP_FAILED)
+        return 0;
+    c->size = size;
+    if (memcmp(c->map, CHECKPOINT_MAGIC, 8) != 0) {
+        munmap(c->map, c->size);
+        return 0;
+    }
+    memcpy(&c->done_count, c->map + 8, sizeof(uint64_t));
+    memcpy(&c->pending_count, c->map + 8 + sizeof(uint64_t), sizeof(uint64_t));
+    c->records = c->map + 8 + 2 * sizeof(uint64_t);
+    return 1;
+}
+
+// Returns the next record as a new refcounted string and advances pos.
+char *checkpoint_next(checkpoint_t *c, char **pos) {
+    uint32_t len;
+    assert(*pos + sizeof(len) <= c->map + c->size);
+    memcpy(&len, *pos, sizeof(len));
+    assert(*pos + sizeof(len) + len <= c->map + c->size);
+    char *str = rcstr_create(*pos + sizeof(len), len);
+    *pos += sizeof(len) + len;
+    return str;
+}
+
+void checkpoint_close(checkpoint_t *c) {
+    munmap(c->map, c->size);
+}
+
 // *************************
 //      main functions
 // *************************
 
-const size_t HASHSET_BUCKETS = 97;
+const size_t HASHSET_BUCKETS = 65536;
+const size_t HASHSET_LOCKS = 97;
+const size_t DEQUE_SIZE = 64;
+const unsigned long PROGRESS_INTERVAL_MS = 1000;
+const unsigned long CHECKPOINT_INTERVAL_MS = 60000;
 
+enum { TASK_FETCH, TASK_PARSE };
+
+struct worker_args;
+
+// Every URL discovered so far has an entry in url_set. An entry's mark
+// is 0 until its page has been parsed, and then the value of epoch at
+// that time. A checkpoint bumps epoch and treats only entries marked
+// before the bump as done: their links were all inserted before they
+// were marked, so the checkpoint is a consistent cut without stopping
+// the workers.
+//
+// With a byte budget the URL frontier is the unbounded frontier instead of
+// url_queue: a parser holds its page's bytes until it has queued the
+// page's links, so it must never block on a full queue.
 struct input_args {
     bounded_buffer_t *url_queue;
+    unbounded_buffer_t *frontier;
     unbounded_buffer_t *page_queue;
+    pool_t *pool;
     hashset_t *url_set;
+    byte_budget_t *budget;
+    append_file_t *spill;
+    append_file_t *edge_file;
+    fpset_t *fingerprints;
+    simhash_index_t *simhashes;
+    slab_t *node_slab;
+    slab_t *entry_slab;
+    slab_t *page_slab;
     char *(*fetch)(char *url);
+    void (*fetch_buffer)(char *url, struct crawl_buffer *buf);
     void (*edge)(char *from, char *to);
-    mutex_t *done_mutex;
-    cond_t *done_cond;
+    void (*edge_batch)(char *from, char **tos, int n);
+    work_counter_t *work;
+    struct worker_args *workers;
+    size_t worker_count;
+    int timed;
+    int normalize;
+    unsigned long start_ns;
+    unsigned long epoch;
+    unsigned int max_depth;
+    unsigned long max_pages;
+    unsigned long max_bytes;
+    unsigned long deadline_ns;
+    unsigned long fetches;
+    unsigned long bytes;
+    int limit_hit;
+};
+
+// Per-thread state. The slab caches are only ever touched by the thread
+// that owns them, or by crawl() once that thread has been joined.
+struct worker_args {
+    struct input_args *in_args;
+    size_t id;
+    slab_cache_t nodes;
+    slab_cache_t entries;
+    slab_cache_t pages;
+    strvec_t links;
+    edge_buffer_t edges;
+    struct crawl_worker_stats stats;
+    unsigned long pages_fetched;
+    unsigned long duplicate_urls;
+    unsigned long duplicate_pages;
+    unsigned long bytes_downloaded;
+    struct crawl_histogram fetch_latency;
+    struct crawl_histogram parse_latency;
 };
 
+// A page whose body was spilled has body.data == NULL and its body at
+// offset in the spill file. url is owned by entry.
 struct page {
+    hashset_entry_t *entry;
     char *url;
-    char *content;
+    struct crawl_buffer body;
+    off_t offset;
 };
 
+void worker_args_init(struct worker_args *w_args, struct input_args *in_args,
+    size_t id, enum crawl_worker_role role) {
+    memset(w_args, 0, sizeof(struct worker_args));
+    w_args->in_args = in_args;
+    w_args->id = id;
+    slab_cache_init(&w_args->nodes, in_args->node_slab);
+    slab_cache_init(&w_args->entries, in_args->entry_slab);
+    slab_cache_init(&w_args->pages, in_args->page_slab);
+    strvec_init(&w_args->links);
+    edge_buffer_init(&w_args->edges);
+    w_args->stats.role = role;
+}
+
+// Called by crawl() once the owning thread is done.
+void worker_args_destroy(struct worker_args *w_args) {
+    if (w_args->in_args->edge_file != NULL)
+        edge_buffer_flush(&w_args->edges, w_args->in_args->edge_file);
+    edge_buffer_destroy(&w_args->edges);
+    strvec_destroy(&w_args->links);
+}
+
+// Only reads the clock when timing was asked for; otherwise every interval
+// measured with it comes out as zero.
+unsigned long worker_clock(struct worker_args *w_args) {
+    return w_args->in_args->timed != 0 ? now_ns() : 0;
+}
+
+// Records the first limit the crawl ran into. From then on no more pages
+// are fetched.
+void hit_limit(struct input_args *in_args, int limit) {
+    int none = CRAWL_LIMIT_NONE;
+    __atomic_compare_exchange_n(&in_args->limit_hit, &none, limit, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+int limit_hit(struct input_args *in_args) {
+    return __atomic_load_n(&in_args->limit_hit, __ATOMIC_RELAXED);
+}
+
+int past_deadline(struct input_args *in_args) {
+    if (in_args->deadline_ns == 0)
+        return 0;
+    if (limit_hit(in_args) == CRAWL_LIMIT_DEADLINE)
+        return 1;
+    if (now_ns() < in_args->deadline_ns)
+        return 0;
+    hit_limit(in_args, CRAWL_LIMIT_DEADLINE);
+    return 1;
+}
+
+// Returns 1 if another page may be fetched, counting it against max_pages.
+int start_fetch(struct input_args *in_args) {
+    if (limit_hit(in_args) != CRAWL_LIMIT_NONE || past_deadline(in_args) != 0)
+        return 0;
+    if (in_args->max_pages == 0)
+        return 1;
+    unsigned long fetches = __atomic_add_fetch(&in_args->fetches, 1, __ATOMIC_RELAXED);
+    if (fetches >= in_args->max_pages)
+        hit_limit(in_args, CRAWL_LIMIT_PAGES);
+    return fetches <= in_args->max_pages;
+}
+
+void enqueue_entry(struct worker_args *w_args, hashset_entry_t *entry) {
+    struct input_args *in_args = w_args->in_args;
+    work_counter_add(in_args->work);
+    if (in_args->pool != NULL) {
+        task_t task = {TASK_FETCH, (void *)entry};
+        pool_push(in_args->pool, w_args->id, task);
+    } else if (in_args->frontier != NULL) {
+        unbounded_buffer_put(in_args->frontier, (void *)entry, &w_args->nodes);
+    } else {
+        bounded_buffer_put(in_args->url_queue, (void *)entry);
+    }
+}
+
+// Returns the next URL to fetch, or NULL once the crawl is over.
+hashset_entry_t *dequeue_entry(struct worker_args *w_args) {
+    struct input_args *in_args = w_args->in_args;
+    if (in_args->frontier != NULL)
+        return (hashset_entry_t *)unbounded_buffer_get(in_args->frontier, &w_args->nodes);
+    return (hashset_entry_t *)bounded_buffer_get(in_args->url_queue);
+}
+
+// Queues url for fetching unless it has been seen before or is past
+// max_depth. The depth of a URL seen before is left as it was, even if
+// this path to it is shorter. Once a limit is hit new URLs are only recorded, so that they
+// end up pending in the checkpoint. Takes over the caller's reference to
+// url.
+void discover_url(struct worker_args *w_args, char *url, unsigned int depth) {
+    struct input_args *in_args = w_args->in_args;
+    if (in_args->max_depth != 0 && depth > in_args->max_depth) {
+        rcstr_release(url);
+        return;
+    }
+    hashset_entry_t *entry = hashset_insert(in_args->url_set, url, &w_args->entries);
+    if (entry == NULL) {
+        stat_add(&w_args->duplicate_urls, 1);
+    } else {
+        entry->depth = depth;
+        if (limit_hit(in_args) == CRAWL_LIMIT_NONE)
+            enqueue_entry(w_args, entry);
+    }
+    rcstr_release(url);
+}
+
+void release_heap_buffer(struct crawl_buffer *buf) {
+    mem_free(buf->data);
+}
+
+void set_heap_buffer(struct crawl_buffer *buf, char *data, size_t len) {
+    buf->data = data;
+    buf->len = len;
+    buf->release = release_heap_buffer;
+    buf->arg = NULL;
+}
+
+void release_buffer(struct crawl_buffer *buf) {
+    if (buf->data != NULL && buf->release != NULL)
+        buf->release(buf);
+    buf->data = NULL;
+}
+
+struct page *fetch_page(struct worker_args *w_args, hashset_entry_t *entry) {
+    struct input_args *in_args = w_args->in_args;
+    struct page *page = (struct page *)slab_alloc(&w_args->pages);
+    page->entry = entry;
+    page->url = entry->str;
+    page->offset = -1;
+    unsigned long start = worker_clock(w_args);
+    if (in_args->fetch_buffer != NULL) {
+        memset(&page->body, 0, sizeof(struct crawl_buffer));
+        in_args->fetch_buffer(entry->str, &page->body);
+    } else {
+        char *content = in_args->fetch(entry->str);
+        if (content != NULL)
+            set_heap_buffer(&page->body, content, strlen(content));
+    }
+    assert(page->body.data != NULL);
+    if (in_args->timed != 0)
+        histogram_record(&w_args->fetch_latency, now_ns() - start);
+    stat_add(&w_args->pages_fetched, 1);
+    stat_add(&w_args->bytes_downloaded, page->body.len);
+    if (in_args->max_bytes != 0) {
+        unsigned long bytes = __atomic_add_fetch(&in_args->bytes, page->body.len, __ATOMIC_RELAXED);
+        if (bytes >= in_args->max_bytes)
+            hit_limit(in_args, CRAWL_LIMIT_BYTES);
+    }
+    return page;
+}
+
+// Returns 1 if content dedup is on and a page with the same body, or with
+// SimHash a nearly the same body, has been fetched before.
+int duplicate_content(struct worker_args *w_args, struct page *page) {
+    struct input_args *in_args = w_args->in_args;
+    int duplicate = 0;
+    if (in_args->fingerprints != NULL)
+        duplicate = !fpset_insert(in_args->fingerprints, hash64(page->body.data, page->body.len));
+    else if (in_args->simhashes != NULL)
+        duplicate = simhash_index_insert(in_args->simhashes, simhash64(page->body.data, page->body.len));
+    if (duplicate != 0)
+        stat_add(&w_args->duplicate_pages, 1);
+    return duplicate;
+}
+
+// Frees the page, marking its URL done for checkpoints unless the page
+// was dropped without being parsed.
+void finish_page(struct worker_args *w_args, struct page *page, int done) {
+    struct input_args *in_args = w_args->in_args;
+    if (done != 0) {
+        unsigned long epoch = __atomic_load_n(&in_args->epoch, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&page->entry->mark, epoch, __ATOMIC_RELEASE);
+    }
+    release_buffer(&page->body);
+    slab_free(&w_args->pages, page);
+}
+
+// Charges the page against the byte budget before it is queued, spilling
+// its body when the budget is full and a spill file is configured.
+void admit_page(struct input_args *in_args, struct page *page) {
+    if (in_args->budget == NULL)
+        return;
+    int can_spill = (in_args->spill != NULL);
+    if (byte_budget_acquire(in_args->budget, page->body.len, can_spill) == 0) {
+        page->offset = append_file_write(in_args->spill, page->body.data, page->body.len);
+        release_buffer(&page->body);
+    }
+}
+
+// Returns the first "link:" in [start, limit), or NULL. Unlike strstr()
+// it does not need a NUL at the end, so fetched buffers are parsed in
+// place without being copied.
+char *find_link(char *start, char *limit) {
+    while (limit - start >= 5) {
+        char *l = (char *)memchr(start, 'l', limit - start - 4);
+        if (l == NULL)
+            return NULL;
+        if (memcmp(l, "link:", 5) == 0)
+            return l;
+        start = l + 1;
+    }
+    return NULL;
+}
+
+void parse_page(struct worker_args *w_args, struct page *page) {
+    struct input_args *in_args = w_args->in_args;
+    if (past_deadline(in_args) != 0) {
+        if (in_args->budget != NULL && page->offset < 0)
+            byte_budget_release(in_args->budget, page->body.len);
+        finish_page(w_args, page, 0);
+        return;
+    }
+    unsigned long parse_start = worker_clock(w_args);
+    if (page->body.data == NULL) {
+        char *data = append_file_read(in_args->spill, page->offset, page->body.len);
+        set_heap_buffer(&page->body, data, page->body.len);
+    }
+    char *start = page->body.data;
+    char *limit = page->body.data + page->body.len;
+    while ((start = find_link(start, limit)) != NULL) {
+        if (start > page->body.data && *(start - 1) != ' ' && *(start - 1) != '\n') {
+            start = start + 5;
+            continue;
+        }
+        char *end = start + 5;
+        while (end < limit && *end != ' ' && *end != '\n' && *end != '\0')
+            end++;
+        strvec_push(&w_args->links, url_create(start + 5, end - (start + 5), in_args->normalize));
+        if (end == limit)
+            break;
+        start = end + 1;
+    }
+    strvec_t *links = &w_args->links;
+    size_t i = 0;
+    if (links->count > 0) {
+        if (in_args->edge_file != NULL)
+            edge_buffer_add(&w_args->edges, in_args->edge_file, page->url, links->items, links->count);
+        if (in_args->edge_batch != NULL) {
+            in_args->edge_batch(page->url, links->items, links->count);
+        } else if (in_args->edge != NULL) {
+            for (i = 0; i < links->count; i++)
+                in_args->edge(page->url, links->items[i]);
+        }
+    }
+    for (i = 0; i < links->count; i++)
+        discover_url(w_args, links->items[i], page->entry->depth + 1);
+    links->count = 0;
+    if (in_args->budget != NULL && page->offset < 0)
+        byte_budget_release(in_args->budget, page->body.len);
+    finish_page(w_args, page, 1);
+    if (in_args->timed != 0)
+        histogram_record(&w_args->parse_latency, now_ns() - parse_start);
+}
+
 void *downloader(void *arg) {
-    struct input_args *in_args = (struct input_args *)arg;
+    struct worker_args *w_args = (struct worker_args *)arg;
+    struct input_args *in_args = w_args->in_args;
+    unsigned long idle_start = worker_clock(w_args);
     while (1) {
-        char *url = (char *)bounded_buffer_get(in_args->url_queue);
-        if (url == NULL)
+        hashset_entry_t *entry = dequeue_entry(w_args);
+        unsigned long busy_start = worker_clock(w_args);
+        stat_add(&w_args->stats.idle_ns, busy_start - idle_start);
+        if (entry == NULL)
             break;
-        if (hashset_contains(in_args->url_set, url) == 0) {
-            hashset_insert(in_args->url_set, url);
-            char *content = in_args->fetch(url);
-            assert(content != NULL);
-            struct page *page = (struct page *)mem_malloc(sizeof(struct page));
-            page->url = url;
-            page->content = content;
-            unbounded_buffer_put(in_args->page_queue, (void *)page);
+        if (start_fetch(in_args) == 0) {
+            work_counter_done(in_args->work);
+            idle_start = worker_clock(w_args);
+            continue;
+        }
+        struct page *page = fetch_page(w_args, entry);
+        if (duplicate_content(w_args, page) != 0) {
+            finish_page(w_args, page, 1);
         } else {
-            mem_free(url);
+            admit_page(in_args, page);
+            work_counter_add(in_args->work);
+            unbounded_buffer_put(in_args->page_queue, (void *)page, &w_args->nodes);
         }
-        bounded_buffer_done(in_args->url_queue);
-        mutex_lock(in_args->done_mutex);
-        cond_signal(in_args->done_cond);
-        mutex_unlock(in_args->done_mutex);
+        work_counter_done(in_args->work);
+        idle_start = worker_clock(w_args);
+        stat_add(&w_args->stats.busy_ns, idle_start - busy_start);
+        stat_add(&w_args->stats.items, 1);
     }
     return NULL;
 }
 
 void *parser(void *arg) {
-    struct input_args *in_args = (struct input_args *)arg;
+    struct worker_args *w_args = (struct worker_args *)arg;
+    struct input_args *in_args = w_args->in_args;
+    unsigned long idle_start = worker_clock(w_args);
     while (1) {
-        struct page *page = (struct page *)unbounded_buffer_get(in_args->page_queue);
+        struct page *page = (struct page *)unbounded_buffer_get(in_args->page_queue, &w_args->nodes);
+        unsigned long busy_start = worker_clock(w_args);
+        stat_add(&w_args->stats.idle_ns, busy_start - idle_start);
         if (page == NULL)
             break;
-        char *start = page->content;
-        while ((start = strstr(start, "link:")) != NULL) {
-            if (start > page->content && *(start - 1) != ' ' && *(start - 1) != '\n') {
-                start = start + 5;
+        parse_page(w_args, page);
+        work_counter_done(in_args->work);
+        idle_start = worker_clock(w_args);
+        stat_add(&w_args->stats.busy_ns, idle_start - busy_start);
+        stat_add(&w_args->stats.items, 1);
+    }
+    return NULL;
+}
+
+// Fetched pages are pushed back onto the fetching worker's own deque, so
+// unless another worker steals it first a page is parsed right after it
+// was fetched, on the same thread.
+void *pool_worker(void *arg) {
+    struct worker_args *w_args = (struct worker_args *)arg;
+    struct input_args *in_args = w_args->in_args;
+    task_t task;
+    unsigned long idle_start = worker_clock(w_args);
+    while (pool_get(in_args->pool, w_args->id, &task) != 0) {
+        unsigned long busy_start = worker_clock(w_args);
+        stat_add(&w_args->stats.idle_ns, busy_start - idle_start);
+        if (task.type == TASK_FETCH) {
+            if (start_fetch(in_args) == 0) {
+                work_counter_done(in_args->work);
+                idle_start = worker_clock(w_args);
                 continue;
             }
-            char *end = start + 5;
-            while (*end != ' ' && *end != '\n' && *end != '\0')
-                end++;
-            if (*end == '\0') {
-                char *url = str_duplicate(start + 5);
-                in_args->edge(page->url, url);
-                bounded_buffer_put(in_args->url_queue, (void *)url);
-                break;
+            struct page *page = fetch_page(w_args, (hashset_entry_t *)task.ptr);
+            if (duplicate_content(w_args, page) != 0) {
+                finish_page(w_args, page, 1);
             } else {
-                char tmp = *end;
-                *end = '\0';
-                char *url = str_duplicate(start + 5);
-                in_args->edge(page->url, url);
-                bounded_buffer_put(in_args->url_queue, (void *)url);
-                *end = tmp;
-                start = end + 1;
+                task_t parse_task = {TASK_PARSE, (void *)page};
+                work_counter_add(in_args->work);
+                pool_push(in_args->pool, w_args->id, parse_task);
             }
+        } else {
+            parse_page(w_args, (struct page *)task.ptr);
         }
-        mem_free(page->url);
-        mem_free(page->content);
-        mem_free(page);
-        unbounded_buffer_done(in_args->page_queue);
-        mutex_lock(in_args->done_mutex);
-        cond_signal(in_args->done_cond);
-        mutex_unlock(in_args->done_mutex);
+        work_counter_done(in_args->work);
+        idle_start = worker_clock(w_args);
+        stat_add(&w_args->stats.busy_ns, idle_start - busy_start);
+        stat_add(&w_args->stats.items, 1);
     }
+    stat_add(&w_args->stats.idle_ns, worker_clock(w_args) - idle_start);
     return NULL;
 }
 
-int crawl(char *start_url, int download_workers, int parse_workers, int queue_size,
-    char *(*_fetch_fn)(char *url), void (*_edge_fn)(char *from, char *to)) {
-    int i;
+// Sums up the per-worker counters into stats, whose workers array must
+// already hold in_args->worker_count entries. Safe to call while the
+// workers are running.
+void collect_stats(struct input_args *in_args, struct crawl_stats *stats) {
+    struct crawl_worker_stats *workers = stats->workers;
+    memset(stats, 0, sizeof(struct crawl_stats));
+    stats->workers = workers;
+    stats->worker_count = in_args->worker_count;
+    stats->elapsed_ns = now_ns() - in_args->start_ns;
+    stats->limit_hit = limit_hit(in_args);
+    size_t i = 0;
+    for (; i < in_args->worker_count; i++) {
+        struct worker_args *w_args = &in_args->workers[i];
+        stats->pages_fetched += stat_read(&w_args->pages_fetched);
+        stats->duplicate_urls += stat_read(&w_args->duplicate_urls);
+        stats->duplicate_pages += stat_read(&w_args->duplicate_pages);
+        stats->bytes_downloaded += stat_read(&w_args->bytes_downloaded);
+        histogram_merge(&stats->fetch_latency, &w_args->fetch_latency);
+        histogram_merge(&stats->parse_latency, &w_args->parse_latency);
+        workers[i].role = w_args->stats.role;
+        workers[i].items = stat_read(&w_args->stats.items);
+        workers[i].busy_ns = stat_read(&w_args->stats.busy_ns);
+        workers[i].idle_ns = stat_read(&w_args->stats.idle_ns);
+    }
+    if (in_args->pool != NULL) {
+        stats->url_queue_high_water = __atomic_load_n(&in_args->pool->high_water, __ATOMIC_RELAXED);
+    } else if (in_args->frontier != NULL) {
+        stats->url_queue_high_water = __atomic_load_n(&in_args->frontier->high_water, __ATOMIC_RELAXED);
+        stats->page_queue_high_water = __atomic_load_n(&in_args->page_queue->high_water, __ATOMIC_RELAXED);
+        stats->page_queue_bytes_high_water = __atomic_load_n(&in_args->budget->high_water, __ATOMIC_RELAXED);
+    } else {
+        stats->url_queue_high_water = __atomic_load_n(&in_args->url_queue->high_water, __ATOMIC_RELAXED);
+        stats->page_queue_high_water = __atomic_load_n(&in_args->page_queue->high_water, __ATOMIC_RELAXED);
+    }
+}
 
-    bounded_buffer_t url_queue;
-    unbounded_buffer_t page_queue;
-    hashset_t url_set;
-    bounded_buffer_init(&url_queue, queue_size);
-    unbounded_buffer_init(&page_queue);
-    hashset_init(&url_set, HASHSET_BUCKETS);
+struct checkpoint_scan {
+    unsigned long epoch;
+    strvec_t done;
+    strvec_t pending;
+};
+
+void checkpoint_scan_entry(hashset_entry_t *entry, void *arg) {
+    struct checkpoint_scan *scan = (struct checkpoint_scan *)arg;
+    unsigned long mark = __atomic_load_n(&entry->mark, __ATOMIC_ACQUIRE);
+    if (mark != 0 && mark < scan->epoch)
+        strvec_push(&scan->done, entry->str);
+    else
+        strvec_push(&scan->pending, entry->str);
+}
+
+// Runs on the crawl() thread while the workers keep going. The strings
+// stay valid without taking references because only crawl() frees them.
+void save_checkpoint(struct input_args *in_args, char *path) {
+    struct checkpoint_scan scan;
+    scan.epoch = __atomic_add_fetch(&in_args->epoch, 1, __ATOMIC_SEQ_CST);
+    strvec_init(&scan.done);
+    strvec_init(&scan.pending);
+    hashset_foreach(in_args->url_set, checkpoint_scan_entry, (void *)&scan);
+    checkpoint_write(path, &scan.done, &scan.pending);
+    strvec_destroy(&scan.done);
+    strvec_destroy(&scan.pending);
+}
+
+// Blocks until there is no work left, reporting progress and writing
+// checkpoints in between if asked to. Also wakes up at the deadline so
+// that it is reported even if no worker gets to check it.
+void wait_for_work(struct input_args *in_args, struct crawl_options *options) {
+    int progress = (options->progress_fn != NULL);
+    int checkpoint = (options->checkpoint_path != NULL);
+    unsigned long deadline = (in_args->deadline_ns + 999999) / 1000000;
+    if (progress == 0 && checkpoint == 0 && deadline == 0) {
+        work_counter_wait(in_args->work);
+        return;
+    }
+    unsigned long progress_interval = options->progress_interval_ms;
+    if (progress_interval == 0)
+        progress_interval = PROGRESS_INTERVAL_MS;
+    unsigned long checkpoint_interval = options->checkpoint_interval_ms;
+    if (checkpoint_interval == 0)
+        checkpoint_interval = CHECKPOINT_INTERVAL_MS;
+    struct crawl_stats snapshot;
+    snapshot.workers = (struct crawl_worker_stats *)mem_calloc(in_args->worker_count,
+        sizeof(struct crawl_worker_stats));
+    unsigned long now = now_ns() / 1000000;
+    unsigned long next_progress = now + progress_interval;
+    unsigned long next_checkpoint = now + checkpoint_interval;
+    while (1) {
+        unsigned long next = ULONG_MAX;
+        if (progress != 0 && next_progress < next)
+            next = next_progress;
+        if (checkpoint != 0 && next_checkpoint < next)
+            next = next_checkpoint;
+        if (deadline != 0 && deadline < next)
+            next = deadline;
+        now = now_ns() / 1000000;
+        if (work_counter_wait_timeout(in_args->work, next > now ? next - now : 0) != 0)
+            break;
+        now = now_ns() / 1000000;
+        if (progress != 0 && now >= next_progress) {
+            collect_stats(in_args, &snapshot);
+            options->progress_fn(&snapshot, options->progress_arg);
+            next_progress = now + progress_interval;
+        }
+        if (checkpoint != 0 && now >= next_checkpoint) {
+            save_checkpoint(in_args, options->checkpoint_path);
+            next_checkpoint = now + checkpoint_interval;
+        }
+        if (deadline != 0 && past_deadline(in_args) != 0)
+            deadline = 0;
+    }
+    mem_free(snapshot.workers);
+}
+
+// Queues the start URL, or everything a checkpoint still had pending
+// after marking its done URLs as seen.
+void seed_crawl(struct worker_args *main_args, char *start_url, checkpoint_t *checkpoint) {
+    if (checkpoint == NULL) {
+        char *url = url_create(start_url, strlen(start_url), main_args->in_args->normalize);
+        discover_url(main_args, url, 0);
+        return;
+    }
+    char *pos = checkpoint->records;
+    uint64_t i = 0;
+    for (; i < checkpoint->done_count; i++) {
+        char *url = checkpoint_next(checkpoint, &pos);
+        hashset_entry_t *entry = hashset_insert(main_args->in_args->url_set, url, &main_args->entries);
+        if (entry != NULL)
+            entry->mark = 1;
+        rcstr_release(url);
+    }
+    for (i = 0; i < checkpoint->pending_count; i++)
+        discover_url(main_args, checkpoint_next(checkpoint, &pos), 0);
+}
 
-    bounded_buffer_put(&url_queue, (void *)str_duplicate(start_url));
+int run_crawl(char *start_url, checkpoint_t *checkpoint, struct crawl_options *options) {
+    int i;
 
-    mutex_t done_mutex;
-    cond_t done_cond;
+    slab_t node_slab;
+    slab_t entry_slab;
+    slab_t page_slab;
+    slab_init(&node_slab, sizeof(node_t));
+    slab_init(&entry_slab, sizeof(hashset_entry_t));
+    slab_init(&page_slab, sizeof(struct page));
 
-    mutex_init(&done_mutex);
-    cond_init(&done_cond);
+    hashset_t url_set;
+    hashset_init(&url_set, HASHSET_BUCKETS, HASHSET_LOCKS);
+
+    // crawl() holds one unit of work until seeding is finished, so the
+    // count cannot drop to zero while the workers are already running.
+    work_counter_t work;
+    work_counter_init(&work, 1);
 
     struct input_args in_args;
-    in_args.url_queue = &url_queue;
-    in_args.page_queue = &page_queue;
+    in_args.url_queue = NULL;
+    in_args.frontier = NULL;
+    in_args.page_queue = NULL;
+    in_args.pool = NULL;
     in_args.url_set = &url_set;
-    in_args.fetch = _fetch_fn;
-    in_args.edge = _edge_fn;
-    in_args.done_mutex = &done_mutex;
-    in_args.done_cond = &done_cond;
-
-    thread_t downloaders[download_workers];
-    thread_t parsers[parse_workers];
-    for (i = 0; i < download_workers; i++)
-        thread_create(&downloaders[i], downloader, (void *)&in_args);
-    for (i = 0; i < parse_workers; i++)
-        thread_create(&parsers[i], parser, (void *)&in_args);
+    in_args.budget = NULL;
+    in_args.spill = NULL;
+    in_args.edge_file = NULL;
+    in_args.fingerprints = NULL;
+    in_args.simhashes = NULL;
+    in_args.node_slab = &node_slab;
+    in_args.entry_slab = &entry_slab;
+    in_args.page_slab = &page_slab;
+    in_args.fetch = options->fetch_fn;
+    in_args.fetch_buffer = options->fetch_buffer_fn;
+    in_args.edge = options->edge_fn;
+    in_args.edge_batch = options->edge_batch_fn;
+    in_args.work = &work;
+    in_args.normalize = options->normalize_urls;
+    in_args.timed = (options->stats != NULL || options->progress_fn != NULL);
+    in_args.start_ns = now_ns();
+    in_args.epoch = 1;
+    in_args.max_depth = options->max_depth > 0 ? options->max_depth : 0;
+    in_args.max_pages = options->max_pages;
+    in_args.max_bytes = options->max_bytes;
+    in_args.deadline_ns = 0;
+    if (options->deadline_ms != 0)
+        in_args.deadline_ns = in_args.start_ns + options->deadline_ms * 1000000;
+    in_args.fetches = 0;
+    in_args.bytes = 0;
+    in_args.limit_hit = CRAWL_LIMIT_NONE;
 
-    while (1) {
-        mutex_lock(&done_mutex);
-        mutex_lock(&url_queue.mutex);
-        mutex_lock(&url_queue.worker_mutex);
-        mutex_lock(&page_queue.mutex);
-        mutex_lock(&page_queue.worker_mutex);
-        if (url_queue.count == 0 && url_queue.workers == 0 &&
-            page_queue.count == 0 && page_queue.workers == 0) {
-            url_queue.done = 1;
-            page_queue.done = 1;
-            cond_broadcast(&url_queue.empty);
-            cond_broadcast(&url_queue.fill);
-            cond_broadcast(&page_queue.fill);
-            mutex_unlock(&url_queue.mutex);
-            mutex_unlock(&url_queue.worker_mutex);
-            mutex_unlock(&page_queue.mutex);
-            mutex_unlock(&page_queue.worker_mutex);
-            mutex_unlock(&done_mutex);
-            break;
+    append_file_t edge_file;
+    if (options->edge_file != NULL) {
+        append_file_open(&edge_file, options->edge_file);
+        in_args.edge_file = &edge_file;
+    }
+
+    fpset_t fingerprints;
+    simhash_index_t simhashes;
+    if (options->dedup_content == CRAWL_DEDUP_EXACT) {
+        fpset_init(&fingerprints);
+        in_args.fingerprints = &fingerprints;
+    } else if (options->dedup_content == CRAWL_DEDUP_SIMHASH) {
+        simhash_index_init(&simhashes);
+        in_args.simhashes = &simhashes;
+    }
+
+    struct worker_args main_args;
+    worker_args_init(&main_args, &in_args, 0, CRAWL_DOWNLOADER);
+
+    if (options->pool_workers > 0) {
+        int workers = options->pool_workers;
+        pool_t pool;
+        pool_init(&pool, workers, DEQUE_SIZE);
+        in_args.pool = &pool;
+
+        thread_t threads[workers];
+        in_args.workers = (struct worker_args *)mem_calloc(workers, sizeof(struct worker_args));
+        in_args.worker_count = workers;
+        for (i = 0; i < workers; i++) {
+            worker_args_init(&in_args.workers[i], &in_args, i, CRAWL_POOL_WORKER);
+            thread_create(&threads[i], pool_worker, (void *)&in_args.workers[i]);
+        }
+
+        seed_crawl(&main_args, start_url, checkpoint);
+        work_counter_done(&work);
+        wait_for_work(&in_args, options);
+        pool_done(&pool);
+
+        for (i = 0; i < workers; i++)
+            thread_join(threads[i], NULL);
+
+        if (options->stats != NULL) {
+            options->stats->workers = (struct crawl_worker_stats *)mem_calloc(workers,
+                sizeof(struct crawl_worker_stats));
+            collect_stats(&in_args, options->stats);
+        }
+        pool_destroy(&pool);
+    } else {
+        int download_workers = options->download_workers;
+        int parse_workers = options->parse_workers;
+        int workers = download_workers + parse_workers;
+        bounded_buffer_t url_queue;
+        unbounded_buffer_t frontier;
+        unbounded_buffer_t page_queue;
+        unbounded_buffer_init(&page_queue, &main_args.nodes);
+        in_args.page_queue = &page_queue;
+        byte_budget_t budget;
+        append_file_t spill;
+        if (options->page_queue_bytes == 0) {
+            bounded_buffer_init(&url_queue, options->queue_size);
+            in_args.url_queue = &url_queue;
         } else {
-            mutex_unlock(&url_queue.mutex);
-            mutex_unlock(&url_queue.worker_mutex);
-            mutex_unlock(&page_queue.mutex);
-            mutex_unlock(&page_queue.worker_mutex);
-            cond_wait(&done_cond, &done_mutex);
-            mutex_unlock(&done_mutex);
+            unbounded_buffer_init(&frontier, &main_args.nodes);
+            in_args.frontier = &frontier;
+            byte_budget_init(&budget, options->page_queue_bytes);
+            in_args.budget = &budget;
+            if (options->spill_dir != NULL) {
+                append_file_temp(&spill, options->spill_dir);
+                in_args.spill = &spill;
+            }
+        }
+
+        thread_t threads[workers];
+        in_args.workers = (struct worker_args *)mem_calloc(workers, sizeof(struct worker_args));
+        in_args.worker_count = workers;
+        for (i = 0; i < download_workers; i++) {
+            worker_args_init(&in_args.workers[i], &in_args, i, CRAWL_DOWNLOADER);
+            thread_create(&threads[i], downloader, (void *)&in_args.workers[i]);
         }
+        for (i = download_workers; i < workers; i++) {
+            worker_args_init(&in_args.workers[i], &in_args, i, CRAWL_PARSER);
+            thread_create(&threads[i], parser, (void *)&in_args.workers[i]);
+        }
+
+        seed_crawl(&main_args, start_url, checkpoint);
+        work_counter_done(&work);
+        wait_for_work(&in_args, options);
+        if (in_args.frontier != NULL)
+            unbounded_buffer_done(&frontier);
+        else
+            bounded_buffer_done(&url_queue);
+        unbounded_buffer_done(&page_queue);
+
+        for (i = 0; i < workers; i++)
+            thread_join(threads[i], NULL);
+
+        if (options->stats != NULL) {
+            options->stats->workers = (struct crawl_worker_stats *)mem_calloc(workers,
+                sizeof(struct crawl_worker_stats));
+            collect_stats(&in_args, options->stats);
+        }
+        if (in_args.frontier != NULL)
+            unbounded_buffer_destroy(&frontier, &main_args.nodes);
+        else
+            bounded_buffer_destroy(&url_queue);
+        unbounded_buffer_destroy(&page_queue, &main_args.nodes);
+        if (in_args.budget != NULL)
+            byte_budget_destroy(&budget);
+        if (in_args.spill != NULL)
+            append_file_close(&spill);
     }
 
-    for (i = 0; i < download_workers; i++)
-        thread_join(downloaders[i], NULL);
-    for (i = 0; i < parse_workers; i++)
-        thread_join(parsers[i], NULL);
+    if (options->checkpoint_path != NULL)
+        save_checkpoint(&in_args, options->checkpoint_path);
 
-    bounded_buffer_destroy(&url_queue);
-    unbounded_buffer_destroy(&page_queue);
-    hashset_destroy(&url_set);
+    for (i = 0; i < in_args.worker_count; i++)
+        worker_args_destroy(&in_args.workers[i]);
+    worker_args_destroy(&main_args);
+    if (in_args.edge_file != NULL)
+        append_file_close(&edge_file);
+    if (in_args.fingerprints != NULL)
+        fpset_destroy(&fingerprints);
+    if (in_args.simhashes != NULL)
+        simhash_index_destroy(&simhashes);
+    mem_free(in_args.workers);
+    hashset_destroy(&url_set, &main_args.entries);
+    work_counter_destroy(&work);
+    slab_destroy(&node_slab);
+    slab_destroy(&entry_slab);
+    slab_destroy(&page_slab);
 
     return 0;
 }
+
+int crawl_with_options(char *start_url, struct crawl_options *options) {
+    return run_crawl(start_url, NULL, options);
+}
+
+int crawl_resume(char *checkpoint_path, struct crawl_options *options) {
+    checkpoint_t checkpoint;
+    if (checkpoint_open(&checkpoint, checkpoint_path) == 0)
+        return -1;
+    int rc = run_crawl(NULL, &checkpoint, options);
+    checkpoint_close(&checkpoint);
+    return rc;
+}
+
+int crawl(char *start_url, int download_workers, int parse_workers, int queue_size,
+    char *(*_fetch_fn)(char *url), void (*_edge_fn)(char *from, char *to)) {
+    struct crawl_options options;
+    memset(&options, 0, sizeof(options));
+    options.download_workers = download_workers;
+    options.parse_workers = parse_workers;
+    options.queue_size = queue_size;
+    options.fetch_fn = _fetch_fn;
+    options.edge_fn = _edge_fn;
+    return run_crawl(start_url, NULL, &options);
+}
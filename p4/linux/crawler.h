@@ -1,6 +1,153 @@
 #ifndef __CRAWLER_H
 #define __CRAWLER_H
 
+// Log-linear latency histogram in nanoseconds: values below 8 get their own
+// bucket, above that every power of two is split into 8 sub-buckets, so a
+// bucket is within 12.5% of the values recorded in it.
+#define CRAWL_HIST_BUCKETS 368
+
+struct crawl_histogram {
+  unsigned long count;
+  unsigned long total_ns;
+  unsigned long min_ns;
+  unsigned long max_ns;
+  unsigned long buckets[CRAWL_HIST_BUCKETS];
+};
+
+enum crawl_worker_role {
+  CRAWL_DOWNLOADER,
+  CRAWL_PARSER,
+  CRAWL_POOL_WORKER
+};
+
+struct crawl_worker_stats {
+  enum crawl_worker_role role;
+  unsigned long items;
+  unsigned long busy_ns;
+  unsigned long idle_ns;
+};
+
+struct crawl_stats {
+  unsigned long elapsed_ns;
+  unsigned long pages_fetched;
+  unsigned long duplicate_urls;
+  unsigned long duplicate_pages;
+  unsigned long bytes_downloaded;
+  // In pool mode url_queue_high_water is the most tasks queued across all
+  // deques at once, and page_queue_high_water is always 0.
+  unsigned long url_queue_high_water;
+  unsigned long page_queue_high_water;
+  // The most bytes page_queue_bytes let in at once, or 0 without it.
+  unsigned long page_queue_bytes_high_water;
+  struct crawl_histogram fetch_latency;
+  struct crawl_histogram parse_latency;
+  // One of enum crawl_limit.
+  int limit_hit;
+  int worker_count;
+  struct crawl_worker_stats *workers;
+};
+
+// Why a crawl ended before running out of URLs.
+enum crawl_limit {
+  CRAWL_LIMIT_NONE,
+  CRAWL_LIMIT_PAGES,
+  CRAWL_LIMIT_BYTES,
+  CRAWL_LIMIT_DEADLINE
+};
+
+// A fetched page body that the crawler does not own, such as a read-only
+// mmap of a stored page. The crawler never writes to data and does not
+// need it to be NUL-terminated. Once it is done with the page it calls
+// release, if set, on a struct with the same fields; arg is for release.
+struct crawl_buffer {
+  char *data;
+  unsigned long len;
+  void (*release)(struct crawl_buffer *buf);
+  void *arg;
+};
+
+enum crawl_dedup {
+  CRAWL_DEDUP_NONE,
+  // Skip pages whose body hashes the same as an earlier page's.
+  CRAWL_DEDUP_EXACT,
+  // Skip pages whose SimHash is within 3 bits of an earlier page's.
+  CRAWL_DEDUP_SIMHASH
+};
+
+struct crawl_options {
+  int download_workers;
+  int parse_workers;
+  int queue_size;
+  // If positive, run this many workers in one work-stealing pool that both
+  // fetches and parses, instead of separate downloaders and parsers.
+  // download_workers, parse_workers and queue_size are then ignored.
+  int pool_workers;
+  // If nonzero, downloaders block while fetched pages waiting for or being
+  // parsed hold more than this many bytes. Only used without pool_workers.
+  // The URL queue is then unbounded and queue_size is ignored, so that
+  // parsers never wait on it while their pages count against the limit.
+  unsigned long page_queue_bytes;
+  // If set together with page_queue_bytes, pages over the budget are
+  // spilled to an unlinked temporary file in this directory instead of
+  // blocking the downloaders.
+  char *spill_dir;
+  // If nonzero, links and the start URL are canonicalized before they are
+  // checked against the visited set, so that variants of one URL are only
+  // fetched once: fragments are dropped, "." and ".." segments resolved,
+  // escapes of unreserved characters decoded, scheme and host lowercased
+  // and trailing slashes removed. fetch_fn and edge_fn see the canonical
+  // form.
+  int normalize_urls;
+  // One of enum crawl_dedup. Duplicate pages are dropped right after they
+  // are fetched: they are not parsed and report no edges.
+  int dedup_content;
+  char * (*fetch_fn)(char *url);
+  // If set, used instead of fetch_fn. It must fill in buf, whose data may
+  // not be NULL; the page is parsed straight from that memory.
+  void (*fetch_buffer_fn)(char *url, struct crawl_buffer *buf);
+  void (*edge_fn)(char *from, char *to);
+  // If set, called once per page with all of its links instead of calling
+  // edge_fn once per link. tos is only valid during the call.
+  void (*edge_batch_fn)(char *from, char **tos, int n);
+  // If set, the link graph is also written to this file, buffered per
+  // thread. Each page with links becomes one record: the page URL, the
+  // number of links, then each link URL, where every URL is a LEB128
+  // length followed by that many bytes and the count is a LEB128 number.
+  char *edge_file;
+  // If set, filled in when the crawl finishes. Release the workers array
+  // with crawl_stats_destroy().
+  struct crawl_stats *stats;
+  // If set, called from the crawl() thread every progress_interval_ms
+  // (default 1000) with a snapshot of the stats so far. The snapshot is
+  // only valid during the call.
+  void (*progress_fn)(struct crawl_stats *stats, void *arg);
+  void *progress_arg;
+  unsigned long progress_interval_ms;
+  // If set, the visited set and pending frontier are written to this file
+  // every checkpoint_interval_ms (default 60000) and when the crawl ends,
+  // while the workers keep running. Pass it to crawl_resume() to continue
+  // a crawl that died. Pages that were mid-parse at checkpoint time are
+  // fetched and parsed again on resume, so some edges may be reported
+  // twice across the two runs.
+  char *checkpoint_path;
+  unsigned long checkpoint_interval_ms;
+  // Limits, each off when 0. Links more than max_depth hops from the start
+  // page are not followed. The first path found to a page sets its depth,
+  // and as the crawl is not strictly breadth-first that need not be the
+  // shortest one, so a page within max_depth may still be cut off. Once
+  // max_pages pages have been fetched, or at least max_bytes bytes, no
+  // more pages are fetched, but the ones already fetched are still parsed.
+  // Past deadline_ms after the crawl started, pages are neither fetched nor
+  // parsed. Either way the workers then drop whatever is still queued and
+  // exit. URLs that were not crawled stay pending in the checkpoint;
+  // depths are not saved, so after crawl_resume() they count as start
+  // pages.
+  int max_depth;
+  unsigned long max_pages;
+  unsigned long max_bytes;
+  unsigned long deadline_ms;
+};
+
 int crawl(char *start_url,
 	  int download_workers,
 	  int parse_workers,
@@ -8,4 +155,16 @@ int crawl(char *start_url,
 	  char * (*fetch_fn)(char *url),
 	  void (*edge_fn)(char *from, char *to));
 
+int crawl_with_options(char *start_url, struct crawl_options *options);
+
+// Continues the crawl saved in checkpoint_path. Returns -1 if the file is
+// missing or not a checkpoint.
+int crawl_resume(char *checkpoint_path, struct crawl_options *options);
+
+void crawl_stats_destroy(struct crawl_stats *stats);
+
+// Returns the lower bound of the bucket holding the given percentile
+// (0 to 100) of the recorded values, or 0 if the histogram is empty.
+unsigned long crawl_histogram_percentile(struct crawl_histogram *h, double percentile);
+
 #endif
@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include "crawler.h"
 
 void *Malloc(size_t size) {
@@ -41,13 +42,52 @@ char *fetch(char *link) {
   return buf;
 }
 
+void unmap(struct crawl_buffer *buf) {
+  munmap(buf->data, buf->len);
+}
+
+// Maps the file instead of reading it, so the crawler parses the page
+// cache directly. Empty files cannot be mapped and get an empty buffer.
+void fetch_mapped(char *link, struct crawl_buffer *buf) {
+  int fd = open(link, O_RDONLY);
+  if (fd < 0) {
+    perror("failed to open file");
+    return;
+  }
+  off_t size = lseek(fd, 0, SEEK_END);
+  assert(size >= 0);
+  if (size == 0) {
+    buf->data = "";
+    buf->len = 0;
+  } else {
+    buf->data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(buf->data != MAP_FAILED);
+    buf->len = size;
+    buf->release = unmap;
+  }
+  close(fd);
+}
+
 void edge(char *from, char *to) {
   printf("%s -> %s\n", from, to);
 }
 
+// file_tester [-m] start_page; -m maps the pages instead of reading them.
 int main(int argc, char *argv[]) {
-  assert(argc == 2);
-  int rc = crawl(argv[1], 1, 1, 1, fetch, edge);
+  int rc;
+  if (argc == 3 && strcmp(argv[1], "-m") == 0) {
+    struct crawl_options options;
+    memset(&options, 0, sizeof(options));
+    options.download_workers = 1;
+    options.parse_workers = 1;
+    options.queue_size = 1;
+    options.fetch_buffer_fn = fetch_mapped;
+    options.edge_fn = edge;
+    rc = crawl_with_options(argv[2], &options);
+  } else {
+    assert(argc == 2);
+    rc = crawl(argv[1], 1, 1, 1, fetch, edge);
+  }
   assert(rc == 0);
   return 0;
 }
@@ -33,7 +33,7 @@ void clientSend(int fd, char *filename)
 
   /* Form and send the HTTP request */
   sprintf(buf, "GET %s HTTP/1.1\n", filename);
-  sprintf(buf, "%shost: %s\n\r\n", buf, hostname);
+  snprintf(buf + strlen(buf), MAXLINE - strlen(buf), "host: %s\n\r\n", hostname);
   Rio_writen(fd, buf, strlen(buf));
 }
 
@@ -0,0 +1,42 @@
+// Checks bitmap_stats() against a bit by bit count for every range of a
+// random bitmap, including ranges within one word that start on a word
+// boundary.
+
+#define main fscheck_main
+#include "fscheck.c"
+#undef main
+
+#define TEST_BITS 320
+
+int main(void) {
+    uchar* bitmap = calloc(1, BSIZE);
+    srand(537);
+    for (uint b = 0; b < TEST_BITS; ++b) {
+        if (rand() % 3 == 0)
+            set_bit(bitmap, b);
+    }
+    for (uint from = 0; from <= TEST_BITS; ++from) {
+        for (uint to = from; to <= TEST_BITS; ++to) {
+            struct bitmap_stats stats;
+            bitmap_stats(bitmap, from, to, &stats);
+            uint used = 0, extents = 0, largest = 0, run = 0;
+            for (uint b = from; b < to; ++b) {
+                used += get_bit(bitmap, b);
+                run = get_bit(bitmap, b) ? 0 : run + 1;
+                extents += (run == 1);
+                largest = run > largest ? run : largest;
+            }
+            if (stats.used != used || stats.free != to - from - used
+                || stats.free_extents != extents || stats.largest_free != largest) {
+                fprintf(stderr, "bitmap_stats(%u, %u): used %u free %u extents %u largest %u, "
+                                "expected %u %u %u %u\n",
+                    from, to, stats.used, stats.free, stats.free_extents, stats.largest_free, used,
+                    to - from - used, extents, largest);
+                return 1;
+            }
+        }
+    }
+    free(bitmap);
+    printf("bitmap_stats: ok\n");
+    return 0;
+}
@@ -8,6 +8,7 @@ typedef unsigned char uchar;
 #define T_DIR  1   // Directory
 #define T_FILE 2   // File
 #define T_DEV  3   // Special device
+#define T_SMALLFILE 4   // Small file, data stored in addrs[]
 
 // On-disk file system format.
 // Both the kernel and user programs use this header file.
@@ -29,6 +30,7 @@ struct superblock {
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
+#define MAXSMALLFILE ((NDIRECT + 1) * sizeof(uint))  // bytes of a small file
 
 // On-disk inode structure
 struct dinode {
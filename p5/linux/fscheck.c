@@ -1,12 +1,25 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "fs.h"
 
 // #define DEBUG
 
+#define SCAN_CHUNK 64
+#define MAX_THREADS 64
+
 const char* IMAGE_NOT_FOUND = "image not found.";
+const char* ERR_IMAGE_SIZE = "ERROR: image smaller than its superblock.";
 const char* ERR_INODE = "ERROR: bad inode.";
 const char* ERR_ADDR_BND = "ERROR: bad address in inode.";
 const char* ERR_DIR_ROOT = "ERROR: root directory does not exist.";
@@ -19,64 +32,1707 @@ const char* ERR_ITBL_USED = "ERROR: inode marked use but not found in a director
 const char* ERR_ITBL_FREE = "ERROR: inode referred to in directory but marked free.";
 const char* ERR_FILE_REF = "ERROR: bad reference count for file.";
 const char* ERR_DIR_REF = "ERROR: directory appears more than once in file system.";
+const char* ERR_SMALL_SIZE = "ERROR: small file larger than its inode.";
+const char* ERR_DIR_LOOP = "ERROR: directory not reachable from root.";
 
-const uchar bit_masks[8] = {0b00000001, 0b00000010, 0b00000100, 0b00001000,
-    0b00010000, 0b00100000, 0b01000000, 0b10000000};
+// Short names for the errors in report-all output.
+const struct {
+    const char** error;
+    const char* name;
+} error_classes[] = {
+    {&ERR_INODE, "bad_inode"},
+    {&ERR_ADDR_BND, "bad_address"},
+    {&ERR_DIR_ROOT, "no_root"},
+    {&ERR_DIR_FMT, "bad_directory"},
+    {&ERR_DIR_PARENT, "parent_mismatch"},
+    {&ERR_DBMP_FREE, "used_block_free"},
+    {&ERR_DBMP_USED, "free_block_used"},
+    {&ERR_ADDR_DUP, "duplicate_address"},
+    {&ERR_ITBL_USED, "unreferenced_inode"},
+    {&ERR_ITBL_FREE, "free_inode_referenced"},
+    {&ERR_FILE_REF, "bad_file_refcount"},
+    {&ERR_DIR_REF, "directory_linked_twice"},
+    {&ERR_SMALL_SIZE, "bad_small_file"},
+    {&ERR_DIR_LOOP, "unreachable_directory"},
+};
 
 uchar get_bit(uchar* bitmap, uint index) {
-    uint location = index >> 3;
-    uint offset = index & 7;
-    return (bitmap[location] & bit_masks[offset]) >> offset;
+    return (bitmap[index >> 3] >> (index & 7)) & 1;
 }
 
 void set_bit(uchar* bitmap, uint index) {
-    uint location = index >> 3;
-    uint offset = index & 7;
-    bitmap[location] |= bit_masks[offset];
+    bitmap[index >> 3] |= 1 << (index & 7);
+}
+
+void clear_bit(uchar* bitmap, uint index) {
+    bitmap[index >> 3] &= ~(1 << (index & 7));
 }
 
+// Atomic, as the inode scan threads share one reconstructed bitmap.
 uchar test_and_set_bit(uchar* bitmap, uint index) {
-    uint location = index >> 3;
-    uint offset = index & 7;
-    uchar old = (bitmap[location] & bit_masks[offset]) >> offset;
-    bitmap[location] |= bit_masks[offset];
-    return old;
+    uchar mask = 1 << (index & 7);
+    return (__atomic_fetch_or(&bitmap[index >> 3], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+// Returns the 64 bits of the bitmap starting at bit 64 * index, with bit
+// b of the bitmap as bit b % 64 of the word. Bitmaps are whole blocks, so
+// there is always a full word to read.
+uint64_t get_word(uchar* bitmap, size_t index) {
+    uint64_t word;
+    memcpy(&word, bitmap + index * 8, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+// Returns the first bit in [from, to) that is set, or clear if value is 0,
+// or to if there is none.
+uint next_bit(uchar* bitmap, uint from, uint to, int value) {
+    if (from >= to)
+        return to;
+    size_t index = from / 64;
+    uint64_t word = get_word(bitmap, index);
+    if (!value)
+        word = ~word;
+    word &= ~(uint64_t)0 << (from % 64);
+    while (word == 0) {
+        if (++index * 64 >= to)
+            return to;
+        word = get_word(bitmap, index);
+        if (!value)
+            word = ~word;
+    }
+    uint bit = index * 64 + __builtin_ctzll(word);
+    return bit < to ? bit : to;
+}
+
+// Block usage of a bitmap range. Fragmentation is the share of free
+// blocks outside the largest free extent.
+struct bitmap_stats {
+    uint used;
+    uint free;
+    uint free_extents;
+    uint largest_free;
+};
+
+void bitmap_stats(uchar* bitmap, uint from, uint to, struct bitmap_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    // Bits before the first whole word, the whole words, and the bits
+    // after them; a range within one word is all tail
+    uint tail = to / 64 * 64 > from ? to / 64 * 64 : from;
+    uint used = 0;
+    for (uint b = from; b < tail && b % 64 != 0; ++b)
+        used += get_bit(bitmap, b);
+    for (size_t w = (from + 63) / 64; (w + 1) * 64 <= to; ++w)
+        used += __builtin_popcountll(get_word(bitmap, w));
+    for (uint b = tail; b < to; ++b)
+        used += get_bit(bitmap, b);
+    stats->used = used;
+    stats->free = (to - from) - used;
+    for (uint b = next_bit(bitmap, from, to, 0); b < to;) {
+        uint end = next_bit(bitmap, b, to, 1);
+        stats->free_extents++;
+        if (end - b > stats->largest_free)
+            stats->largest_free = end - b;
+        b = next_bit(bitmap, end, to, 0);
+    }
+}
+
+void print_stats(struct bitmap_stats* stats) {
+    printf("data blocks: %u used, %u free in %u extents, largest free extent %u, "
+           "fragmentation %.1f%%\n",
+        stats->used, stats->free, stats->free_extents, stats->largest_free,
+        stats->free ? 100.0 * (stats->free - stats->largest_free) / stats->free : 0.0);
+}
+
+// How the small file optimization suits the image: regular files small
+// enough to be stored inline, with the blocks that would free, and small
+// files at the size limit, which cannot grow and may be better off as
+// regular files.
+void print_file_stats(struct dinode* inode_tbl, uint ninodes) {
+    uint files = 0, small = 0, to_inline = 0, blocks = 0, to_blocks = 0;
+    for (uint i = 0; i < ninodes; ++i) {
+        struct dinode* inode = &inode_tbl[i];
+        if (inode->type == T_SMALLFILE) {
+            small++;
+            to_blocks += (inode->size >= MAXSMALLFILE);
+        } else if (inode->type == T_FILE) {
+            files++;
+            if (inode->size > MAXSMALLFILE)
+                continue;
+            to_inline++;
+            for (uint j = 0; j <= NDIRECT; ++j)
+                blocks += (inode->addrs[j] != 0);
+        }
+    }
+    printf("small files: %u of %u files inline, %u regular files fit inline (%u blocks), "
+           "%u small files at the %u byte limit\n",
+        small, files + small, to_inline, blocks, to_blocks, (uint)MAXSMALLFILE);
+}
+
+// A growable array.
+struct list {
+    uint* items;
+    size_t count;
+    size_t capacity;
+};
+
+void list_add(struct list* list, uint item) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        list->items = realloc(list->items, list->capacity * sizeof(uint));
+    }
+    list->items[list->count++] = item;
+}
+
+// A directory entry: directory dir refers to inode inum.
+struct edge {
+    uint dir;
+    uint inum;
+};
+
+struct edge_list {
+    struct edge* items;
+    size_t count;
+    size_t capacity;
+};
+
+void edge_add(struct edge_list* list, uint dir, uint inum) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        list->items = realloc(list->items, list->capacity * sizeof(struct edge));
+    }
+    list->items[list->count].dir = dir;
+    list->items[list->count].inum = inum;
+    list->count++;
+}
+
+// Returns block addr of the mapped image.
+void* get_block(uchar* image, uint addr) {
+    return image + (size_t)addr * BSIZE;
+}
+
+// Passes of the check, in the order they run.
+enum {
+    STAGE_SCAN,
+    STAGE_BITMAP,
+    STAGE_INODES
+};
+
+// An inconsistency; inode and block are -1 where they do not apply.
+struct problem {
+    const char* error;
+    int stage;
+    long inode;
+    long block;
+};
+
+// Problems found so far. Normally only the first one is kept and the
+// check stops there; during the scan that is the one with the lowest
+// inode number, since threads reach inodes out of order. In report-all
+// mode every problem is kept and the check runs to the end.
+struct report {
+    int all;
+    int stage;
+    pthread_mutex_t mutex;
+    struct problem* problems;
+    size_t count;
+    size_t capacity;
+    long stop_inode;
+};
+
+// Records a problem and returns 1 if the check should stop.
+int problem(struct report* report, const char* error, long inode, long block) {
+    pthread_mutex_lock(&report->mutex);
+    if (report->all) {
+        if (report->count == report->capacity) {
+            report->capacity = report->capacity ? report->capacity * 2 : 64;
+            report->problems = realloc(report->problems, report->capacity * sizeof(struct problem));
+        }
+        struct problem* p = &report->problems[report->count++];
+        p->error = error;
+        p->stage = report->stage;
+        p->inode = inode;
+        p->block = block;
+    } else if (report->count == 0 || inode < report->problems[0].inode) {
+        report->problems[0].error = error;
+        report->problems[0].stage = report->stage;
+        report->problems[0].inode = inode;
+        report->problems[0].block = block;
+        report->count = 1;
+        __atomic_store_n(&report->stop_inode, inode, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&report->mutex);
+    return !report->all;
+}
+
+// Outside report-all mode, prints the first problem and exits if there is
+// one.
+void report_first(struct report* report) {
+    if (!report->all && report->count > 0) {
+        fprintf(stderr, "%s\n", report->problems[0].error);
+        exit(1);
+    }
+}
+
+// Returns the index of error in error_classes.
+size_t error_class(const char* error) {
+    size_t i = 0;
+    while (i < sizeof(error_classes) / sizeof(error_classes[0]) && *error_classes[i].error != error)
+        ++i;
+    return i;
+}
+
+const char* error_name(const char* error) {
+    size_t i = error_class(error);
+    return i < sizeof(error_classes) / sizeof(error_classes[0]) ? error_classes[i].name : "unknown";
+}
+
+// Orders every field, so that the output does not depend on the order in
+// which threads found the problems.
+int compare_problems(const void* a, const void* b) {
+    const struct problem* x = a;
+    const struct problem* y = b;
+    if (x->stage != y->stage)
+        return x->stage < y->stage ? -1 : 1;
+    if (x->inode != y->inode)
+        return x->inode < y->inode ? -1 : 1;
+    if (x->block != y->block)
+        return x->block < y->block ? -1 : 1;
+    if (x->error != y->error)
+        return error_class(x->error) < error_class(y->error) ? -1 : 1;
+    return 0;
+}
+
+// Prints the number, or null / nothing for -1.
+void print_field(long value, const char* none) {
+    if (value < 0)
+        printf("%s", none);
+    else
+        printf("%ld", value);
+}
+
+// Writes every problem to stdout as a JSON array or as CSV with a header
+// line, ordered by pass, inode and block. Messages contain no quotes or
+// backslashes, so they need no escaping.
+void report_print(struct report* report, int json) {
+    if (report->count > 0)
+        qsort(report->problems, report->count, sizeof(struct problem), compare_problems);
+    if (json)
+        printf("[");
+    else
+        printf("class,inode,block,message\n");
+    for (size_t i = 0; i < report->count; ++i) {
+        struct problem* p = &report->problems[i];
+        if (json) {
+            printf("%s\n  {\"class\": \"%s\", \"inode\": ", i ? "," : "", error_name(p->error));
+            print_field(p->inode, "null");
+            printf(", \"block\": ");
+            print_field(p->block, "null");
+            printf(", \"message\": \"%s\"}", p->error);
+        } else {
+            printf("%s,", error_name(p->error));
+            print_field(p->inode, "");
+            printf(",");
+            print_field(p->block, "");
+            printf(",\"%s\"\n", p->error);
+        }
+    }
+    if (json)
+        printf("%s]\n", report->count ? "\n" : "");
+}
+
+struct shard;
+
+// Inode scan state shared by all threads. Each inode is scanned by exactly
+// one thread, so parent_map needs no locking; bitmap_rec is only updated
+// with test_and_set_bit(). owner is the lowest numbered inode using each
+// block, filled in by the claim passes before the scan proper, so that a
+// duplicate is blamed on the same inode whichever thread gets there first.
+struct scan {
+    uchar* image;
+    struct superblock super_blk;
+    struct dinode* inode_tbl;
+    uint data_region;
+    uchar* bitmap;
+    uchar* bitmap_rec;
+    uint* owner;
+    ushort* parent_map;
+    uchar* skip;
+    uint next;
+    struct report* report;
+    int (*pass)(struct scan* scan, struct shard* shard, uint i);
+};
+
+// Per-thread counts and the directory entries found, summed up once all
+// threads are done.
+struct shard {
+    struct scan* scan;
+    ushort* ref_count;
+    ushort* child_map;
+    struct edge_list edges;
+    pthread_t thread;
+};
+
+uint valid_block(struct scan* scan, uint addr) {
+    return addr >= scan->data_region && addr < scan->super_blk.size;
+}
+
+// Lowers the owner of block addr to inode i.
+void claim(struct scan* scan, uint addr, uint i) {
+    uint owner = __atomic_load_n(&scan->owner[addr], __ATOMIC_RELAXED);
+    while (i < owner
+        && !__atomic_compare_exchange_n(&scan->owner[addr], &owner, i, 1, __ATOMIC_RELAXED,
+            __ATOMIC_RELAXED))
+        ;
+}
+
+// First claim pass: the direct blocks and the indirect block of inode i.
+int claim_direct(struct scan* scan, struct shard* shard, uint i) {
+    struct dinode* inode = &scan->inode_tbl[i];
+    if (inode->type == 0 || inode->type > T_DEV)
+        return 0;
+    for (uint j = 0; j <= NDIRECT; ++j) {
+        if (valid_block(scan, inode->addrs[j]))
+            claim(scan, inode->addrs[j], i);
+    }
+    return 0;
+}
+
+// Second claim pass: the blocks listed in the indirect block of inode i,
+// if the scan is going to read them, that is if inode i is the first to
+// use the indirect block.
+int claim_indirect(struct scan* scan, struct shard* shard, uint i) {
+    struct dinode* inode = &scan->inode_tbl[i];
+    uint addr = inode->addrs[NDIRECT];
+    if (inode->type == 0 || inode->type > T_DEV || !valid_block(scan, addr)
+        || scan->owner[addr] != i || get_bit(scan->bitmap_rec, addr))
+        return 0;
+    for (uint j = 0; j < NDIRECT; ++j) {
+        if (inode->addrs[j] == addr)
+            return 0;
+    }
+    uint* indirect_blk = get_block(scan->image, addr);
+    for (uint j = 0; j < NINDIRECT && indirect_blk[j] != 0; ++j) {
+        if (valid_block(scan, indirect_blk[j]))
+            claim(scan, indirect_blk[j], i);
+    }
+    return 0;
+}
+
+// Returns 1 if this is where a sequential scan would see block addr
+// first: inode i owns it and has not used it yet.
+int first_use(struct scan* scan, uint addr, uint i) {
+    return scan->owner[addr] == i && test_and_set_bit(scan->bitmap_rec, addr) == 0;
+}
+
+// Checks inode i and records the blocks and directory entries it uses.
+// Returns 1 if a problem was found and the check should stop.
+int scan_inode(struct scan* scan, struct shard* shard, uint i) {
+    uchar* image = scan->image;
+    struct superblock super_blk = scan->super_blk;
+    struct dinode* inode_tbl = scan->inode_tbl;
+    uint data_region = scan->data_region;
+    ushort* parent_map = scan->parent_map;
+    ushort* ref_count = shard->ref_count;
+    ushort* child_map = shard->child_map;
+    struct report* report = scan->report;
+
+    if (inode_tbl[i].type == 0) {
+        return 0;
+    } else if (inode_tbl[i].type > T_SMALLFILE) {
+        return problem(report, ERR_INODE, i, -1);
+    } else {
+        if (i == 1 && inode_tbl[i].type != T_DIR) {
+            if (problem(report, ERR_DIR_ROOT, i, -1))
+                return 1;
+        }
+        // Small files keep their data in addrs[], not block addresses
+        if (inode_tbl[i].type == T_SMALLFILE) {
+            if (inode_tbl[i].size > MAXSMALLFILE)
+                return problem(report, ERR_SMALL_SIZE, i, -1);
+            return 0;
+        }
+        for (uint j = 0; j < NDIRECT; ++j) {
+            if (inode_tbl[i].addrs[j] == 0) {
+                // break;
+            } else if (inode_tbl[i].addrs[j] >= super_blk.size
+                || inode_tbl[i].addrs[j] < data_region) {
+                if (problem(report, ERR_ADDR_BND, i, inode_tbl[i].addrs[j]))
+                    return 1;
+            } else if (!first_use(scan, inode_tbl[i].addrs[j], i)) {
+                if (problem(report, ERR_ADDR_DUP, i, inode_tbl[i].addrs[j]))
+                    return 1;
+            } else if (inode_tbl[i].type == T_DIR) {
+                struct dirent* dirent = get_block(image, inode_tbl[i].addrs[j]);
+                uint k = 0;
+                if (j == 0) {
+                    if (strcmp(dirent[0].name, ".") != 0 || strcmp(dirent[1].name, "..") != 0) {
+                        if (problem(report, ERR_DIR_FMT, i, inode_tbl[i].addrs[j]))
+                            return 1;
+                    }
+                    if (i == 1 && dirent[1].inum != 1) {
+                        if (problem(report, ERR_DIR_ROOT, i, inode_tbl[i].addrs[j]))
+                            return 1;
+                    }
+                    parent_map[i] = dirent[1].inum;
+                    k = 2;
+                }
+                for (; k < DPB; ++k) {
+                    if (dirent[k].inum >= super_blk.ninodes) {
+                        if (problem(report, ERR_ITBL_FREE, dirent[k].inum, inode_tbl[i].addrs[j]))
+                            return 1;
+                    } else if (dirent[k].inum != 0) {
+                        ref_count[dirent[k].inum] += 1;
+                        child_map[dirent[k].inum] = i;
+                        edge_add(&shard->edges, i, dirent[k].inum);
+                    }
+                }
+            }
+        }
+        if (inode_tbl[i].addrs[NDIRECT] == 0) {
+        } else if (inode_tbl[i].addrs[NDIRECT] >= super_blk.size
+            || inode_tbl[i].addrs[NDIRECT] < data_region) {
+            if (problem(report, ERR_ADDR_BND, i, inode_tbl[i].addrs[NDIRECT]))
+                return 1;
+        } else if (!first_use(scan, inode_tbl[i].addrs[NDIRECT], i)) {
+            if (problem(report, ERR_ADDR_DUP, i, inode_tbl[i].addrs[NDIRECT]))
+                return 1;
+        } else {
+            uint* indirect_blk = get_block(image, inode_tbl[i].addrs[NDIRECT]);
+            for (uint j = 0; j < NINDIRECT; ++j) {
+                if (indirect_blk[j] == 0) {
+                    break;
+                } else if (indirect_blk[j] >= super_blk.size
+                    || indirect_blk[j] < data_region) {
+                    if (problem(report, ERR_ADDR_BND, i, indirect_blk[j]))
+                        return 1;
+                } else if (!first_use(scan, indirect_blk[j], i)) {
+                    if (problem(report, ERR_ADDR_DUP, i, indirect_blk[j]))
+                        return 1;
+                } else if (inode_tbl[i].type == T_DIR) {
+                    struct dirent* dirent = get_block(image, indirect_blk[j]);
+                    for (uint k = 0; k < DPB; ++k) {
+                        if (dirent[k].inum >= super_blk.ninodes) {
+                            if (problem(report, ERR_ITBL_FREE, dirent[k].inum, indirect_blk[j]))
+                                return 1;
+                        } else if (dirent[k].inum != 0) {
+                            ref_count[dirent[k].inum] += 1;
+                            child_map[dirent[k].inum] = i;
+                            edge_add(&shard->edges, i, dirent[k].inum);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Threads claim SCAN_CHUNK inodes at a time. As in a sequential scan only
+// the error of the lowest numbered inode is reported, and threads stop
+// once they are past it.
+void* scan_worker(void* arg) {
+    struct shard* shard = arg;
+    struct scan* scan = shard->scan;
+    while (1) {
+        uint begin = __atomic_fetch_add(&scan->next, SCAN_CHUNK, __ATOMIC_RELAXED);
+        if (begin >= scan->super_blk.ninodes)
+            break;
+        if (scan->skip != NULL && scan->skip[begin / SCAN_CHUNK])
+            continue;
+        uint end = begin + SCAN_CHUNK;
+        if (end > scan->super_blk.ninodes)
+            end = scan->super_blk.ninodes;
+        for (uint i = begin; i < end; ++i) {
+            if (i >= __atomic_load_n(&scan->report->stop_inode, __ATOMIC_RELAXED))
+                return NULL;
+            if (scan->pass(scan, shard, i) != 0)
+                return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Directory tree check. Every directory has one entry referring to it and
+// a matching ".." by the time this runs, so the directories that a search
+// from the root does not reach are exactly those on or below a cycle.
+// Linear in inodes and entries: the edges are bucketed by directory, then
+// searched breadth-first.
+void check_tree(struct scan* scan, struct edge_list* edges, ushort* ref_count) {
+    uint ninodes = scan->super_blk.ninodes;
+    if (ninodes <= ROOTINO)
+        return;
+    uint* start = calloc(ninodes + 1, sizeof(uint));
+    uint* child = malloc((edges->count ? edges->count : 1) * sizeof(uint));
+    for (size_t e = 0; e < edges->count; ++e)
+        start[edges->items[e].dir + 1]++;
+    for (uint i = 0; i < ninodes; ++i)
+        start[i + 1] += start[i];
+    uint* fill = malloc(ninodes * sizeof(uint));
+    memcpy(fill, start, ninodes * sizeof(uint));
+    for (size_t e = 0; e < edges->count; ++e)
+        child[fill[edges->items[e].dir]++] = edges->items[e].inum;
+    free(fill);
+
+    uchar* reached = calloc(ninodes, 1);
+    uint* queue = malloc(ninodes * sizeof(uint));
+    uint head = 0, tail = 0;
+    reached[ROOTINO] = 1;
+    queue[tail++] = ROOTINO;
+    while (head < tail) {
+        uint dir = queue[head++];
+        for (uint e = start[dir]; e < start[dir + 1]; ++e) {
+            uint inum = child[e];
+            if (reached[inum])
+                continue;
+            reached[inum] = 1;
+            if (scan->inode_tbl[inum].type == T_DIR)
+                queue[tail++] = inum;
+        }
+    }
+    for (uint i = 0; i < ninodes; ++i) {
+        if (scan->inode_tbl[i].type == T_DIR && ref_count[i] > 0 && !reached[i]
+            && problem(scan->report, ERR_DIR_LOOP, i, -1))
+            break;
+    }
+    free(queue);
+    free(reached);
+    free(child);
+    free(start);
+}
+
+// Streaming check, for images whose per-inode tables do not fit in
+// memory. Blocks and inodes are handled in windows whose bookkeeping fits
+// in the memory limit: each block window rescans the inode table for the
+// addresses that fall into it, and each inode window rescans the
+// directories for entries that refer into it. Counts are 32-bit, and only
+// the image itself is read, through the page cache, which can drop it at
+// will.
+
+// Smallest windows, so that tiny limits do not mean endless rescans.
+#define MIN_WINDOW 4096
+
+// Per-inode checks that need no other inode: type, root, address bounds
+// and the "." and ".." entries of directories.
+int check_inode(struct scan* scan, uint i) {
+    struct dinode* inode = &scan->inode_tbl[i];
+    struct report* report = scan->report;
+    if (inode->type == 0)
+        return 0;
+    if (inode->type > T_SMALLFILE)
+        return problem(report, ERR_INODE, i, -1);
+    if (i == 1 && inode->type != T_DIR && problem(report, ERR_DIR_ROOT, i, -1))
+        return 1;
+    if (inode->type == T_SMALLFILE)
+        return inode->size > MAXSMALLFILE && problem(report, ERR_SMALL_SIZE, i, -1);
+    for (uint j = 0; j < NDIRECT; ++j) {
+        if (inode->addrs[j] == 0)
+            continue;
+        if (!valid_block(scan, inode->addrs[j])) {
+            if (problem(report, ERR_ADDR_BND, i, inode->addrs[j]))
+                return 1;
+        } else if (j == 0 && inode->type == T_DIR) {
+            struct dirent* dirent = get_block(scan->image, inode->addrs[0]);
+            if ((strcmp(dirent[0].name, ".") != 0 || strcmp(dirent[1].name, "..") != 0)
+                && problem(report, ERR_DIR_FMT, i, inode->addrs[0]))
+                return 1;
+            if (i == 1 && dirent[1].inum != 1 && problem(report, ERR_DIR_ROOT, i, inode->addrs[0]))
+                return 1;
+        }
+    }
+    if (inode->addrs[NDIRECT] == 0)
+        return 0;
+    if (!valid_block(scan, inode->addrs[NDIRECT]))
+        return problem(report, ERR_ADDR_BND, i, inode->addrs[NDIRECT]);
+    uint* indirect_blk = get_block(scan->image, inode->addrs[NDIRECT]);
+    for (uint j = 0; j < NINDIRECT && indirect_blk[j] != 0; ++j) {
+        if (!valid_block(scan, indirect_blk[j]) && problem(report, ERR_ADDR_BND, i, indirect_blk[j]))
+            return 1;
+    }
+    return 0;
+}
+
+// Marks the blocks of inode i that fall into [lo, hi) in claimed, which
+// starts at block lo, reporting blocks that are already marked.
+int claim_blocks(struct scan* scan, uint i, uchar* claimed, uint lo, uint hi) {
+    struct dinode* inode = &scan->inode_tbl[i];
+    uint addrs[NDIRECT + 1 + NINDIRECT];
+    uint n = 0;
+    for (uint j = 0; j <= NDIRECT; ++j) {
+        if (inode->addrs[j] != 0 && valid_block(scan, inode->addrs[j]))
+            addrs[n++] = inode->addrs[j];
+    }
+    if (inode->addrs[NDIRECT] != 0 && valid_block(scan, inode->addrs[NDIRECT])) {
+        uint* indirect_blk = get_block(scan->image, inode->addrs[NDIRECT]);
+        for (uint j = 0; j < NINDIRECT && indirect_blk[j] != 0; ++j) {
+            if (valid_block(scan, indirect_blk[j]))
+                addrs[n++] = indirect_blk[j];
+        }
+    }
+    for (uint j = 0; j < n; ++j) {
+        if (addrs[j] >= lo && addrs[j] < hi && test_and_set_bit(claimed, addrs[j] - lo) != 0
+            && problem(scan->report, ERR_ADDR_DUP, i, addrs[j]))
+            return 1;
+    }
+    return 0;
+}
+
+// Counts the entries of directory block addr that refer to inodes in
+// [lo, hi), skipping "." and ".." in the first block.
+int count_entries(struct scan* scan, uint dir, uint addr, int first,
+    uint* ref_count, uint* child_map, uint lo, uint hi) {
+    struct dirent* dirent = get_block(scan->image, addr);
+    for (uint k = first ? 2 : 0; k < DPB; ++k) {
+        uint inum = dirent[k].inum;
+        if (inum >= scan->super_blk.ninodes) {
+            if (lo == 0 && problem(scan->report, ERR_ITBL_FREE, inum, addr))
+                return 1;
+        } else if (inum != 0 && inum >= lo && inum < hi) {
+            ref_count[inum - lo] += 1;
+            child_map[inum - lo] = dir;
+        }
+    }
+    return 0;
+}
+
+int count_refs(struct scan* scan, uint dir, uint* ref_count, uint* child_map, uint lo, uint hi) {
+    struct dinode* inode = &scan->inode_tbl[dir];
+    for (uint j = 0; j < NDIRECT; ++j) {
+        if (inode->addrs[j] != 0 && valid_block(scan, inode->addrs[j])
+            && count_entries(scan, dir, inode->addrs[j], j == 0, ref_count, child_map, lo, hi))
+            return 1;
+    }
+    if (inode->addrs[NDIRECT] == 0 || !valid_block(scan, inode->addrs[NDIRECT]))
+        return 0;
+    uint* indirect_blk = get_block(scan->image, inode->addrs[NDIRECT]);
+    for (uint j = 0; j < NINDIRECT && indirect_blk[j] != 0; ++j) {
+        if (valid_block(scan, indirect_blk[j])
+            && count_entries(scan, dir, indirect_blk[j], 0, ref_count, child_map, lo, hi))
+            return 1;
+    }
+    return 0;
+}
+
+// Runs every check within about memory bytes of bookkeeping.
+void stream_check(struct scan* scan, size_t memory) {
+    struct report* report = scan->report;
+    struct superblock* sb = &scan->super_blk;
+    uint ninodes = sb->ninodes;
+
+    // Per-Inode Checks
+    report->stage = STAGE_SCAN;
+    for (uint i = 0; i < ninodes; ++i) {
+        if (check_inode(scan, i))
+            break;
+    }
+    report_first(report);
+
+    // Block Windows - Duplicates and Bitmap. Without report-all the first
+    // bitmap mismatch is held back until no window has a duplicate left,
+    // so the error matches the one the in-memory check would give.
+    size_t window = (memory / 2) * 8;
+    if (window < MIN_WINDOW)
+        window = MIN_WINDOW;
+    uchar* claimed = malloc(window / 8);
+    const char* mismatch = NULL;
+    long mismatch_block = -1;
+    for (size_t lo = 0; lo < sb->size; lo += window) {
+        uint hi = lo + window < sb->size ? lo + window : sb->size;
+        memset(claimed, 0, window / 8);
+        for (uint b = lo; b < hi && b < scan->data_region; ++b)
+            set_bit(claimed, b - lo);
+        report->stage = STAGE_SCAN;
+        for (uint i = 0; i < ninodes; ++i) {
+            if (scan->inode_tbl[i].type != 0 && scan->inode_tbl[i].type <= T_DEV
+                && claim_blocks(scan, i, claimed, lo, hi))
+                break;
+        }
+        report_first(report);
+        report->stage = STAGE_BITMAP;
+        for (uint b = lo; b < hi; ++b) {
+            uchar used = get_bit(claimed, b - lo);
+            uchar marked = get_bit(scan->bitmap, b);
+            if (used == marked)
+                continue;
+            const char* error = used > marked ? ERR_DBMP_FREE : ERR_DBMP_USED;
+            if (report->all) {
+                problem(report, error, -1, b);
+            } else if (mismatch == NULL) {
+                mismatch = error;
+                mismatch_block = b;
+            }
+        }
+    }
+    free(claimed);
+    if (mismatch != NULL)
+        problem(report, mismatch, -1, mismatch_block);
+    report_first(report);
+
+    // Inode Windows - References
+    window = memory / (2 * sizeof(uint));
+    if (window < MIN_WINDOW)
+        window = MIN_WINDOW;
+    uint* ref_count = malloc(window * sizeof(uint));
+    uint* child_map = malloc(window * sizeof(uint));
+    report->stage = STAGE_INODES;
+    int stop = 0;
+    for (size_t lo = 0; lo < ninodes && !stop; lo += window) {
+        uint hi = lo + window < ninodes ? lo + window : ninodes;
+        memset(ref_count, 0, window * sizeof(uint));
+        memset(child_map, 0, window * sizeof(uint));
+        if (lo <= 1 && hi > 1) {
+            ref_count[1 - lo] = 1;
+            child_map[1 - lo] = 1;
+        }
+        for (uint d = 0; d < ninodes && !stop; ++d) {
+            if (scan->inode_tbl[d].type == T_DIR)
+                stop = count_refs(scan, d, ref_count, child_map, lo, hi);
+        }
+        for (uint i = lo; i < hi && !stop; ++i) {
+            struct dinode* inode = &scan->inode_tbl[i];
+            uint refs = ref_count[i - lo];
+            if (inode->type == 0) {
+                if (refs > 0)
+                    stop = problem(report, ERR_ITBL_FREE, i, -1);
+            } else if (refs == 0) {
+                stop = problem(report, ERR_ITBL_USED, i, -1);
+            } else if (inode->type == T_DIR) {
+                uint parent = 0;
+                if (valid_block(scan, inode->addrs[0]))
+                    parent = ((struct dirent*)get_block(scan->image, inode->addrs[0]))[1].inum;
+                if (refs > 1)
+                    stop = problem(report, ERR_DIR_REF, i, -1);
+                else if (parent != child_map[i - lo])
+                    stop = problem(report, ERR_DIR_PARENT, i, -1);
+            } else if (inode->type == T_FILE || inode->type == T_SMALLFILE) {
+                if (inode->nlink != refs)
+                    stop = problem(report, ERR_FILE_REF, i, -1);
+            }
+        }
+    }
+    free(ref_count);
+    free(child_map);
+    report_first(report);
+}
+
+// Layout analysis: how the blocks of files and directories are placed.
+// An extent is a run of blocks that are adjacent on disk and in the file.
+// There is no access data on disk to tell which files are hot, so the
+// files the first-fit allocator scattered the most are listed instead;
+// scatter is the span of a file's blocks over its block count.
+
+#define SIZE_BUCKETS 12
+#define WORST_FILES 5
+
+struct scattered {
+    uint inode;
+    uint blocks;
+    uint extents;
+    uint span;
+};
+
+struct layout {
+    uint files;
+    uint blocks;
+    uint extents;
+    uint contiguous;
+    double distance;
+    uint max_distance;
+    uint dir_blocks;
+    uint dir_entries;
+    uint sizes[SIZE_BUCKETS];
+    struct scattered worst[WORST_FILES];
+};
+
+// Collects the valid data blocks of inode i in file order and returns how
+// many there are.
+uint file_blocks(struct scan* scan, uint i, uint* addrs) {
+    struct dinode* inode = &scan->inode_tbl[i];
+    uint n = 0;
+    for (uint j = 0; j < NDIRECT; ++j) {
+        if (inode->addrs[j] != 0 && valid_block(scan, inode->addrs[j]))
+            addrs[n++] = inode->addrs[j];
+    }
+    if (inode->addrs[NDIRECT] != 0 && valid_block(scan, inode->addrs[NDIRECT])) {
+        uint* indirect_blk = get_block(scan->image, inode->addrs[NDIRECT]);
+        for (uint j = 0; j < NINDIRECT && indirect_blk[j] != 0; ++j) {
+            if (valid_block(scan, indirect_blk[j]))
+                addrs[n++] = indirect_blk[j];
+        }
+    }
+    return n;
+}
+
+// Bucket 0 holds empty files, bucket k sizes up to 32 << k bytes, and the
+// last one everything larger.
+uint size_bucket(uint size) {
+    uint k = 0;
+    while (k < SIZE_BUCKETS - 1 && (k == 0 ? size > 0 : size > (32u << k)))
+        ++k;
+    return k;
+}
+
+// Keeps the WORST_FILES files with the most extents, then the widest span.
+void add_scattered(struct layout* layout, struct scattered* file) {
+    uint k = WORST_FILES;
+    while (k > 0 && (layout->worst[k - 1].blocks == 0
+        || file->extents > layout->worst[k - 1].extents
+        || (file->extents == layout->worst[k - 1].extents && file->span > layout->worst[k - 1].span)))
+        --k;
+    if (k == WORST_FILES)
+        return;
+    memmove(&layout->worst[k + 1], &layout->worst[k], (WORST_FILES - k - 1) * sizeof(*file));
+    layout->worst[k] = *file;
+}
+
+void analyze_layout(struct scan* scan, struct layout* layout) {
+    memset(layout, 0, sizeof(*layout));
+    uint addrs[NDIRECT + NINDIRECT];
+    for (uint i = 0; i < scan->super_blk.ninodes; ++i) {
+        struct dinode* inode = &scan->inode_tbl[i];
+        if (inode->type != T_FILE && inode->type != T_DIR && inode->type != T_SMALLFILE)
+            continue;
+        if (inode->type != T_DIR)
+            layout->sizes[size_bucket(inode->size)]++;
+        uint n = inode->type == T_SMALLFILE ? 0 : file_blocks(scan, i, addrs);
+        if (n == 0)
+            continue;
+        struct scattered file = {i, n, 1, 1};
+        uint lo = addrs[0], hi = addrs[0];
+        for (uint j = 1; j < n; ++j) {
+            file.extents += (addrs[j] != addrs[j - 1] + 1);
+            lo = addrs[j] < lo ? addrs[j] : lo;
+            hi = addrs[j] > hi ? addrs[j] : hi;
+        }
+        file.span = hi - lo + 1;
+        uint distance = addrs[0] - IBLOCK(i);
+        layout->files++;
+        layout->blocks += n;
+        layout->extents += file.extents;
+        layout->contiguous += (file.extents == 1);
+        layout->distance += distance;
+        if (distance > layout->max_distance)
+            layout->max_distance = distance;
+        if (file.extents > 1)
+            add_scattered(layout, &file);
+        if (inode->type != T_DIR)
+            continue;
+        for (uint j = 0; j < n; ++j) {
+            struct dirent* dirent = get_block(scan->image, addrs[j]);
+            layout->dir_blocks++;
+            for (uint k = 0; k < DPB; ++k)
+                layout->dir_entries += (dirent[k].inum != 0);
+        }
+    }
+}
+
+void print_layout(struct layout* layout) {
+    printf("layout: %u files and directories, %u blocks in %u extents, %u contiguous\n",
+        layout->files, layout->blocks, layout->extents, layout->contiguous);
+    printf("inode to data distance: mean %.1f blocks, max %u\n",
+        layout->files ? layout->distance / layout->files : 0.0, layout->max_distance);
+    printf("directory fill: %u of %u entries used (%.1f%%)\n", layout->dir_entries,
+        layout->dir_blocks * (uint)DPB,
+        layout->dir_blocks ? 100.0 * layout->dir_entries / (layout->dir_blocks * DPB) : 0.0);
+    printf("file sizes:\n");
+    for (uint k = 0; k < SIZE_BUCKETS; ++k) {
+        if (layout->sizes[k] == 0)
+            continue;
+        if (k == 0)
+            printf("  %-12s %u\n", "empty", layout->sizes[k]);
+        else if (k == SIZE_BUCKETS - 1)
+            printf("  > %-10u %u\n", 32u << (k - 1), layout->sizes[k]);
+        else
+            printf("  <= %-9u %u\n", 32u << k, layout->sizes[k]);
+    }
+    printf("most scattered:\n");
+    for (uint k = 0; k < WORST_FILES && layout->worst[k].blocks != 0; ++k) {
+        struct scattered* file = &layout->worst[k];
+        printf("  inode %u: %u blocks in %u extents, scatter %.1f\n", file->inode, file->blocks,
+            file->extents, (double)file->span / file->blocks);
+    }
+}
+
+// Repair, for images whose only problems are ones fscheck can fix without
+// guessing: the data bitmap, file link counts, ".." entries, entries that
+// refer to free inodes and inodes no directory refers to. Changed blocks
+// are copied out of the read-only mapping on first write and collected;
+// they are then written to a journal next to the image, which is synced
+// before any of them goes to the image itself. A journal left behind by a
+// crash is replayed by the next repair; one that was not fully written is
+// discarded, as the image was not touched yet.
+
+#define JOURNAL_MAGIC "FSCKJNL1"
+
+struct repair {
+    struct scan* scan;
+    ushort* ref_count;
+    ushort* child_map;
+    uint bitmap_start;
+    uchar** dirty;
+    uint ndirty;
+    uint lost_found;
+    uint cleared;
+    uint relinked;
+    uint unlinked;
+    uint parents;
+    uint nlinks;
+};
+
+// Errors that repair does not attempt, as fixing them means deciding which
+// of two claims on a block or directory is the right one.
+const char** unrepairable[] = {
+    &ERR_INODE, &ERR_ADDR_BND, &ERR_DIR_ROOT, &ERR_DIR_FMT, &ERR_ADDR_DUP, &ERR_DIR_REF,
+    &ERR_SMALL_SIZE, &ERR_DIR_LOOP,
+};
+
+// Returns block addr as repaired so far.
+void* repair_read(struct repair* r, uint addr) {
+    return r->dirty[addr] ? r->dirty[addr] : get_block(r->scan->image, addr);
+}
+
+// Returns a writable copy of block addr, which is written back on commit.
+void* repair_write(struct repair* r, uint addr) {
+    if (r->dirty[addr] == NULL) {
+        r->dirty[addr] = malloc(BSIZE);
+        memcpy(r->dirty[addr], get_block(r->scan->image, addr), BSIZE);
+        r->ndirty++;
+    }
+    return r->dirty[addr];
+}
+
+struct dinode* repair_inode(struct repair* r, uint i, int write) {
+    struct dinode* blk = write ? repair_write(r, IBLOCK(i)) : repair_read(r, IBLOCK(i));
+    return blk + i % IPB;
+}
+
+// Collects the data blocks of inode i, direct ones first, and returns how
+// many there are.
+uint inode_blocks(struct repair* r, uint i, uint* addrs) {
+    struct dinode* inode = repair_inode(r, i, 0);
+    uint n = 0;
+    if (inode->type == T_SMALLFILE)
+        return 0;
+    for (uint j = 0; j < NDIRECT; ++j) {
+        if (inode->addrs[j] != 0)
+            addrs[n++] = inode->addrs[j];
+    }
+    if (inode->addrs[NDIRECT] != 0) {
+        uint* indirect_blk = repair_read(r, inode->addrs[NDIRECT]);
+        for (uint j = 0; j < NINDIRECT && indirect_blk[j] != 0; ++j)
+            addrs[n++] = indirect_blk[j];
+    }
+    return n;
+}
+
+// Returns a zeroed block taken from the reconstructed bitmap, or 0.
+uint alloc_block(struct repair* r) {
+    uint size = r->scan->super_blk.size;
+    uint b = next_bit(r->scan->bitmap_rec, r->scan->data_region, size, 0);
+    if (b == size)
+        return 0;
+    set_bit(r->scan->bitmap_rec, b);
+    memset(repair_write(r, b), 0, BSIZE);
+    return b;
+}
+
+// Adds an entry to directory dir, growing it by a direct block if it is
+// full. Returns 0 if there is no room.
+int dir_add(struct repair* r, uint dir, uint inum, const char* name) {
+    uint addrs[NDIRECT + NINDIRECT];
+    uint n = inode_blocks(r, dir, addrs);
+    for (uint j = 0; j < n; ++j) {
+        struct dirent* dirent = repair_read(r, addrs[j]);
+        for (uint k = j == 0 ? 2 : 0; k < DPB; ++k) {
+            if (dirent[k].inum == 0) {
+                dirent = repair_write(r, addrs[j]);
+                dirent[k].inum = inum;
+                strncpy(dirent[k].name, name, DIRSIZ);
+                return 1;
+            }
+        }
+    }
+    struct dinode* inode = repair_inode(r, dir, 0);
+    uint j = 0;
+    while (j < NDIRECT && inode->addrs[j] != 0)
+        ++j;
+    uint addr = j < NDIRECT ? alloc_block(r) : 0;
+    if (addr == 0)
+        return 0;
+    inode = repair_inode(r, dir, 1);
+    inode->addrs[j] = addr;
+    if (inode->size < (j + 1) * BSIZE)
+        inode->size = (j + 1) * BSIZE;
+    struct dirent* dirent = repair_write(r, addr);
+    dirent[0].inum = inum;
+    strncpy(dirent[0].name, name, DIRSIZ);
+    return 1;
+}
+
+// Finds or makes /lost+found and returns its inode, or 0 if there is no
+// free inode or block for it.
+uint lost_found(struct repair* r) {
+    if (r->lost_found != 0)
+        return r->lost_found;
+    uint addrs[NDIRECT + NINDIRECT];
+    uint n = inode_blocks(r, ROOTINO, addrs);
+    for (uint j = 0; j < n; ++j) {
+        struct dirent* dirent = repair_read(r, addrs[j]);
+        for (uint k = 0; k < DPB; ++k) {
+            if (dirent[k].inum != 0 && strncmp(dirent[k].name, "lost+found", DIRSIZ) == 0
+                && repair_inode(r, dirent[k].inum, 0)->type == T_DIR)
+                return r->lost_found = dirent[k].inum;
+        }
+    }
+    uint inum = 0;
+    for (uint i = ROOTINO + 1; i < r->scan->super_blk.ninodes && inum == 0; ++i) {
+        if (repair_inode(r, i, 0)->type == 0 && r->ref_count[i] == 0)
+            inum = i;
+    }
+    uint addr = inum != 0 ? alloc_block(r) : 0;
+    if (addr == 0)
+        return 0;
+    struct dirent* dirent = repair_write(r, addr);
+    dirent[0].inum = inum;
+    strcpy(dirent[0].name, ".");
+    dirent[1].inum = ROOTINO;
+    strcpy(dirent[1].name, "..");
+    struct dinode* inode = repair_inode(r, inum, 1);
+    memset(inode, 0, sizeof(*inode));
+    inode->type = T_DIR;
+    inode->nlink = 1;
+    inode->size = BSIZE;
+    inode->addrs[0] = addr;
+    if (!dir_add(r, ROOTINO, inum, "lost+found")) {
+        // Leaves the block marked in use; the next repair frees it.
+        memset(inode, 0, sizeof(*inode));
+        return 0;
+    }
+    r->ref_count[inum] = 1;
+    r->child_map[inum] = ROOTINO;
+    return r->lost_found = inum;
+}
+
+// Removes directory entries that refer to free or nonexistent inodes.
+void unlink_free(struct repair* r) {
+    uint ninodes = r->scan->super_blk.ninodes;
+    uint addrs[NDIRECT + NINDIRECT];
+    for (uint d = 0; d < ninodes; ++d) {
+        if (repair_inode(r, d, 0)->type != T_DIR)
+            continue;
+        uint n = inode_blocks(r, d, addrs);
+        for (uint j = 0; j < n; ++j) {
+            struct dirent* dirent = repair_read(r, addrs[j]);
+            for (uint k = j == 0 ? 2 : 0; k < DPB; ++k) {
+                uint inum = dirent[k].inum;
+                if (inum == 0 || (inum < ninodes && repair_inode(r, inum, 0)->type != 0))
+                    continue;
+                dirent = repair_write(r, addrs[j]);
+                memset(&dirent[k], 0, sizeof(struct dirent));
+                if (inum < ninodes)
+                    r->ref_count[inum] = 0;
+                r->unlinked++;
+            }
+        }
+    }
+}
+
+// Whether unreferenced inode i holds nothing worth keeping.
+int empty_inode(struct repair* r, uint i) {
+    struct dinode* inode = repair_inode(r, i, 0);
+    if (inode->type == T_FILE || inode->type == T_SMALLFILE)
+        return inode->size == 0;
+    if (inode->type != T_DIR)
+        return 0;
+    uint addrs[NDIRECT + NINDIRECT];
+    uint n = inode_blocks(r, i, addrs);
+    for (uint j = 0; j < n; ++j) {
+        struct dirent* dirent = repair_read(r, addrs[j]);
+        for (uint k = j == 0 ? 2 : 0; k < DPB; ++k) {
+            if (dirent[k].inum != 0)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+// Clears unreferenced inodes that are empty, freeing their blocks, and
+// links the others into /lost+found as "#<inode>".
+void relink_orphans(struct repair* r) {
+    uint addrs[NDIRECT + NINDIRECT];
+    for (uint i = ROOTINO + 1; i < r->scan->super_blk.ninodes; ++i) {
+        if (repair_inode(r, i, 0)->type == 0 || r->ref_count[i] != 0 || i == r->lost_found)
+            continue;
+        if (empty_inode(r, i)) {
+            uint n = inode_blocks(r, i, addrs);
+            for (uint j = 0; j < n; ++j)
+                clear_bit(r->scan->bitmap_rec, addrs[j]);
+            struct dinode* inode = repair_inode(r, i, 0);
+            if (inode->type != T_SMALLFILE && inode->addrs[NDIRECT] != 0)
+                clear_bit(r->scan->bitmap_rec, inode->addrs[NDIRECT]);
+            memset(repair_inode(r, i, 1), 0, sizeof(struct dinode));
+            r->cleared++;
+            continue;
+        }
+        char name[DIRSIZ];
+        snprintf(name, sizeof(name), "#%u", i);
+        uint dir = lost_found(r);
+        if (dir == 0 || !dir_add(r, dir, i, name)) {
+            fprintf(stderr, "repair: no room in lost+found for inode %u.\n", i);
+            continue;
+        }
+        r->ref_count[i] = 1;
+        r->child_map[i] = dir;
+        r->relinked++;
+    }
+}
+
+// Points the ".." entry of every directory at the directory that refers
+// to it, and sets file link counts to the number of entries.
+void fix_links(struct repair* r) {
+    for (uint i = ROOTINO + 1; i < r->scan->super_blk.ninodes; ++i) {
+        struct dinode* inode = repair_inode(r, i, 0);
+        if (r->ref_count[i] == 0) {
+        } else if (inode->type == T_DIR && inode->addrs[0] != 0) {
+            struct dirent* dirent = repair_read(r, inode->addrs[0]);
+            if (dirent[1].inum != r->child_map[i]) {
+                dirent = repair_write(r, inode->addrs[0]);
+                dirent[1].inum = r->child_map[i];
+                r->parents++;
+            }
+        } else if ((inode->type == T_FILE || inode->type == T_SMALLFILE)
+            && inode->nlink != r->ref_count[i]) {
+            repair_inode(r, i, 1)->nlink = r->ref_count[i];
+            r->nlinks++;
+        }
+    }
+}
+
+// Copies the reconstructed bitmap over the blocks of the on-disk one that
+// differ from it, and returns how many did.
+uint fix_bitmap(struct repair* r, uint bitmap_blks) {
+    uint changed = 0;
+    for (uint j = 0; j < bitmap_blks; ++j) {
+        uchar* rec = r->scan->bitmap_rec + (size_t)j * BSIZE;
+        if (memcmp(repair_read(r, r->bitmap_start + j), rec, BSIZE) != 0) {
+            memcpy(repair_write(r, r->bitmap_start + j), rec, BSIZE);
+            changed++;
+        }
+    }
+    return changed;
+}
+
+// FNV-1a, to tell a complete journal from one cut short by a crash.
+unsigned long long checksum(unsigned long long hash, const void* data, size_t len) {
+    const uchar* p = data;
+    for (size_t i = 0; i < len; ++i)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    return hash;
+}
+
+int write_all(int fd, const void* data, size_t len) {
+    const uchar* p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0)
+            return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Syncs the directory holding path, so that a new file in it survives a
+// crash.
+void sync_dir(const char* path) {
+    char dir[4096];
+    const char* slash = strrchr(path, '/');
+    if (slash == NULL)
+        strcpy(dir, ".");
+    else
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path + 1), path);
+    int fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// Journal layout: the magic, the block count, then each block as its
+// address and contents, then the checksum of all of it.
+int journal_write(struct repair* r, const char* journal, uint size) {
+    int fd = open(journal, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return 0;
+    unsigned long long hash = 14695981039346656037ULL;
+    int ok = write_all(fd, JOURNAL_MAGIC, 8) && write_all(fd, &r->ndirty, sizeof(uint));
+    hash = checksum(hash, JOURNAL_MAGIC, 8);
+    hash = checksum(hash, &r->ndirty, sizeof(uint));
+    for (uint b = 0; b < size && ok; ++b) {
+        if (r->dirty[b] == NULL)
+            continue;
+        ok = write_all(fd, &b, sizeof(uint)) && write_all(fd, r->dirty[b], BSIZE);
+        hash = checksum(hash, &b, sizeof(uint));
+        hash = checksum(hash, r->dirty[b], BSIZE);
+    }
+    ok = ok && write_all(fd, &hash, sizeof(hash)) && fsync(fd) == 0;
+    close(fd);
+    if (ok)
+        sync_dir(journal);
+    return ok;
+}
+
+// Applies a complete journal to the image and removes it. Returns the
+// number of blocks written, 0 if there was no usable journal, or -1 if
+// writing the image failed, in which case the journal is kept.
+int journal_replay(int fd, const char* journal, uint image_blks) {
+    int jfd = open(journal, O_RDONLY);
+    if (jfd < 0)
+        return 0;
+    struct stat st;
+    uchar* data = NULL;
+    if (fstat(jfd, &st) == 0 && st.st_size >= 8 + (off_t)sizeof(uint) + 8) {
+        data = malloc(st.st_size);
+        if (pread(jfd, data, st.st_size, 0) != st.st_size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    close(jfd);
+    uint count = 0;
+    size_t record = sizeof(uint) + BSIZE;
+    size_t body = 0;
+    int valid = 0;
+    if (data != NULL && memcmp(data, JOURNAL_MAGIC, 8) == 0) {
+        memcpy(&count, data + 8, sizeof(uint));
+        body = 8 + sizeof(uint) + (size_t)count * record;
+        unsigned long long hash;
+        if ((size_t)st.st_size == body + sizeof(hash)) {
+            memcpy(&hash, data + body, sizeof(hash));
+            valid = (checksum(14695981039346656037ULL, data, body) == hash);
+        }
+    }
+    int written = 0;
+    for (uint j = 0; j < count && valid && written >= 0; ++j) {
+        uchar* rec = data + 8 + sizeof(uint) + (size_t)j * record;
+        uint addr;
+        memcpy(&addr, rec, sizeof(uint));
+        if (addr >= image_blks
+            || pwrite(fd, rec + sizeof(uint), BSIZE, (off_t)addr * BSIZE) != BSIZE)
+            written = -1;
+        else
+            written++;
+    }
+    free(data);
+    if (written < 0 || (valid && fsync(fd) != 0))
+        return -1;
+    unlink(journal);
+    return written;
+}
+
+// Repairs the problems in report. Returns 0 if the image is consistent
+// afterwards, 1 if some problems could not be repaired, in which case
+// nothing is written.
+int repair_image(struct repair* r, struct report* report, int fd, const char* journal,
+    uint bitmap_blks) {
+    int fixable = 1;
+    for (size_t p = 0; p < report->count; ++p) {
+        for (size_t e = 0; e < sizeof(unrepairable) / sizeof(unrepairable[0]); ++e) {
+            if (report->problems[p].error == *unrepairable[e]) {
+                fprintf(stderr, "cannot repair: %s\n", report->problems[p].error);
+                fixable = 0;
+            }
+        }
+    }
+    if (!fixable || report->count == 0)
+        return !fixable;
+
+    uint size = r->scan->super_blk.size;
+    r->dirty = calloc(size, sizeof(uchar*));
+    unlink_free(r);
+    relink_orphans(r);
+    fix_links(r);
+    uint bitmap_fixed = fix_bitmap(r, bitmap_blks);
+
+    int ok = journal_write(r, journal, size);
+    for (uint b = 0; b < size && ok; ++b) {
+        if (r->dirty[b] != NULL)
+            ok = (pwrite(fd, r->dirty[b], BSIZE, (off_t)b * BSIZE) == BSIZE);
+    }
+    ok = ok && fsync(fd) == 0 && unlink(journal) == 0;
+    for (uint b = 0; b < size; ++b)
+        free(r->dirty[b]);
+    free(r->dirty);
+    if (!ok) {
+        fprintf(stderr, "repair: writing the image failed.\n");
+        return 1;
+    }
+    printf("repaired: %u blocks written, %u bitmap blocks, %u link counts, %u parent entries, "
+           "%u entries removed, %u inodes cleared, %u relinked\n",
+        r->ndirty, bitmap_fixed, r->nlinks, r->parents, r->unlinked, r->cleared, r->relinked);
+    return 0;
+}
+
+// Incremental check. After a clean check a summary can be saved next to
+// the image. For each group of SCAN_CHUNK inodes it records a checksum of
+// everything the scan reads for the group: its inodes and their indirect
+// and directory blocks. It also records what the scan derived from them:
+// the blocks the group uses, its directory entries and its ".." entries.
+// Later checks only scan the groups whose checksum changed and take the
+// rest from the summary. Directory blocks are still read to checksum
+// them, but they are not parsed again. The bitmap is always compared in
+// full, as it is only a few blocks.
+
+#define SUMMARY_MAGIC "FSCKSUM2"
+
+struct summary {
+    uint ngroups;
+    uint64_t* hashes;
+    uint* block_start;
+    struct list blocks;
+    uint* ref_start;
+    struct edge_list refs;
+    ushort* parent_map;
+};
+
+void summary_free(struct summary* summary) {
+    free(summary->hashes);
+    free(summary->block_start);
+    free(summary->blocks.items);
+    free(summary->ref_start);
+    free(summary->refs.items);
+    free(summary->parent_map);
+    memset(summary, 0, sizeof(*summary));
+}
+
+// A word at a time; len is a multiple of 8.
+uint64_t hash_words(uint64_t hash, const void* data, size_t len) {
+    const uchar* p = data;
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+// Calls visit on every valid block of inode i, in the order the scan uses
+// them, and returns the hash of the inode and the blocks the scan reads.
+// For directory blocks, visit is also given the first entry that counts
+// as a reference; it is -1 for the indirect block and for file blocks.
+uint64_t walk_inode(struct scan* scan, uint i, uint64_t hash,
+    void (*visit)(struct scan*, uint, uint, int, void*), void* arg) {
+    struct dinode* inode = &scan->inode_tbl[i];
+    hash = hash_words(hash, inode, sizeof(*inode));
+    if (inode->type == 0 || inode->type > T_DEV)
+        return hash;
+    for (uint j = 0; j < NDIRECT; ++j) {
+        if (inode->addrs[j] == 0 || !valid_block(scan, inode->addrs[j]))
+            continue;
+        int entries = inode->type != T_DIR ? -1 : j == 0 ? 2 : 0;
+        if (entries >= 0)
+            hash = hash_words(hash, get_block(scan->image, inode->addrs[j]), BSIZE);
+        if (visit)
+            visit(scan, i, inode->addrs[j], entries, arg);
+    }
+    if (inode->addrs[NDIRECT] == 0 || !valid_block(scan, inode->addrs[NDIRECT]))
+        return hash;
+    uint* indirect_blk = get_block(scan->image, inode->addrs[NDIRECT]);
+    hash = hash_words(hash, indirect_blk, BSIZE);
+    if (visit)
+        visit(scan, i, inode->addrs[NDIRECT], -1, arg);
+    for (uint j = 0; j < NINDIRECT && indirect_blk[j] != 0; ++j) {
+        if (!valid_block(scan, indirect_blk[j]))
+            continue;
+        int entries = inode->type != T_DIR ? -1 : 0;
+        if (entries >= 0)
+            hash = hash_words(hash, get_block(scan->image, indirect_blk[j]), BSIZE);
+        if (visit)
+            visit(scan, i, indirect_blk[j], entries, arg);
+    }
+    return hash;
+}
+
+// Adds a block of inode i, and its directory entries, to the summary.
+void summarize_block(struct scan* scan, uint i, uint addr, int entries, void* arg) {
+    struct summary* summary = arg;
+    list_add(&summary->blocks, addr);
+    if (entries < 0)
+        return;
+    struct dirent* dirent = get_block(scan->image, addr);
+    for (uint k = entries; k < DPB; ++k) {
+        if (dirent[k].inum != 0 && dirent[k].inum < scan->super_blk.ninodes)
+            edge_add(&summary->refs, i, dirent[k].inum);
+    }
+}
+
+// Checksums every inode group.
+void summary_hash(struct scan* scan, struct summary* summary) {
+    summary->ngroups = (scan->super_blk.ninodes + SCAN_CHUNK - 1) / SCAN_CHUNK;
+    summary->hashes = calloc(summary->ngroups, sizeof(uint64_t));
+    for (uint i = 0; i < scan->super_blk.ninodes; ++i)
+        summary->hashes[i / SCAN_CHUNK] = walk_inode(scan, i, summary->hashes[i / SCAN_CHUNK],
+            NULL, NULL);
+}
+
+// Marks the groups that are unchanged since old in scan->skip and adds
+// what old recorded for them to the check's tables.
+uint summary_apply(struct scan* scan, struct summary* cur, struct summary* old,
+    ushort* ref_count, ushort* child_map, struct edge_list* edges) {
+    uint skipped = 0;
+    for (uint g = 0; g < cur->ngroups; ++g) {
+        if (old->ngroups != cur->ngroups || old->hashes[g] != cur->hashes[g])
+            continue;
+        scan->skip[g] = 1;
+        skipped++;
+        for (uint b = old->block_start[g]; b < old->block_start[g + 1]; ++b)
+            set_bit(scan->bitmap_rec, old->blocks.items[b]);
+        for (uint r = old->ref_start[g]; r < old->ref_start[g + 1]; ++r) {
+            struct edge* ref = &old->refs.items[r];
+            ref_count[ref->inum] += 1;
+            child_map[ref->inum] = ref->dir;
+            edge_add(edges, ref->dir, ref->inum);
+        }
+        uint end = (g + 1) * SCAN_CHUNK < scan->super_blk.ninodes ? (g + 1) * SCAN_CHUNK
+                                                                  : scan->super_blk.ninodes;
+        for (uint i = g * SCAN_CHUNK; i < end; ++i)
+            scan->parent_map[i] = old->parent_map[i];
+    }
+    return skipped;
+}
+
+// Fills in the blocks and entries of every group, from old for the groups
+// that were skipped.
+void summary_build(struct scan* scan, struct summary* cur, struct summary* old) {
+    cur->block_start = calloc(cur->ngroups + 1, sizeof(uint));
+    cur->ref_start = calloc(cur->ngroups + 1, sizeof(uint));
+    for (uint g = 0; g < cur->ngroups; ++g) {
+        cur->block_start[g] = cur->blocks.count;
+        cur->ref_start[g] = cur->refs.count;
+        if (scan->skip[g]) {
+            for (uint b = old->block_start[g]; b < old->block_start[g + 1]; ++b)
+                list_add(&cur->blocks, old->blocks.items[b]);
+            for (uint r = old->ref_start[g]; r < old->ref_start[g + 1]; ++r)
+                edge_add(&cur->refs, old->refs.items[r].dir, old->refs.items[r].inum);
+            continue;
+        }
+        for (uint i = g * SCAN_CHUNK; i < (g + 1) * SCAN_CHUNK && i < scan->super_blk.ninodes; ++i)
+            walk_inode(scan, i, 0, summarize_block, cur);
+    }
+    cur->block_start[cur->ngroups] = cur->blocks.count;
+    cur->ref_start[cur->ngroups] = cur->refs.count;
+    cur->parent_map = malloc(scan->super_blk.ninodes * sizeof(ushort));
+    memcpy(cur->parent_map, scan->parent_map, scan->super_blk.ninodes * sizeof(ushort));
+}
+
+// Layout: the magic, the superblock, the group, block and entry counts,
+// the group checksums, the block and entry offsets of each group, the
+// blocks, the entries as directory and inode pairs, the ".." entry of each inode, and the checksum of
+// all of it. Written to a temporary file that then replaces the summary.
+int summary_save(struct summary* summary, struct superblock* super_blk, const char* path) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 0;
+    uint counts[3] = {summary->ngroups, summary->blocks.count, summary->refs.count};
+    struct {
+        const void* data;
+        size_t len;
+    } parts[] = {
+        {SUMMARY_MAGIC, 8},
+        {super_blk, sizeof(*super_blk)},
+        {counts, sizeof(counts)},
+        {summary->hashes, summary->ngroups * sizeof(uint64_t)},
+        {summary->block_start, (summary->ngroups + 1) * sizeof(uint)},
+        {summary->ref_start, (summary->ngroups + 1) * sizeof(uint)},
+        {summary->blocks.items, summary->blocks.count * sizeof(uint)},
+        {summary->refs.items, summary->refs.count * sizeof(struct edge)},
+        {summary->parent_map, super_blk->ninodes * sizeof(ushort)},
+    };
+    unsigned long long hash = 14695981039346656037ULL;
+    int ok = 1;
+    for (size_t p = 0; p < sizeof(parts) / sizeof(parts[0]) && ok; ++p) {
+        ok = write_all(fd, parts[p].data, parts[p].len);
+        hash = checksum(hash, parts[p].data, parts[p].len);
+    }
+    ok = ok && write_all(fd, &hash, sizeof(hash));
+    close(fd);
+    if (ok && rename(tmp, path) == 0)
+        return 1;
+    unlink(tmp);
+    return 0;
+}
+
+// Reads the summary at path if it is complete and was saved for an image
+// with the same superblock. Returns 0 otherwise.
+int summary_load(struct summary* summary, struct superblock* super_blk, const char* path) {
+    memset(summary, 0, sizeof(*summary));
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0)
+        return 0;
+    uchar* data = NULL;
+    if (fstat(fd, &st) == 0) {
+        data = malloc(st.st_size);
+        if (read(fd, data, st.st_size) != st.st_size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    close(fd);
+    size_t head = 8 + sizeof(struct superblock) + 3 * sizeof(uint);
+    uint counts[3];
+    if (data == NULL || (size_t)st.st_size < head || memcmp(data, SUMMARY_MAGIC, 8) != 0
+        || memcmp(data + 8, super_blk, sizeof(*super_blk)) != 0) {
+        free(data);
+        return 0;
+    }
+    memcpy(counts, data + 8 + sizeof(*super_blk), sizeof(counts));
+    size_t sizes[] = {
+        counts[0] * sizeof(uint64_t),
+        (counts[0] + (size_t)1) * sizeof(uint),
+        (counts[0] + (size_t)1) * sizeof(uint),
+        counts[1] * sizeof(uint),
+        counts[2] * sizeof(struct edge),
+        super_blk->ninodes * sizeof(ushort),
+    };
+    size_t body = head;
+    for (size_t p = 0; p < sizeof(sizes) / sizeof(sizes[0]); ++p)
+        body += sizes[p];
+    unsigned long long hash;
+    if ((size_t)st.st_size != body + sizeof(hash)) {
+        free(data);
+        return 0;
+    }
+    memcpy(&hash, data + body, sizeof(hash));
+    if (checksum(14695981039346656037ULL, data, body) != hash) {
+        free(data);
+        return 0;
+    }
+    void** fields[] = {
+        (void**)&summary->hashes,
+        (void**)&summary->block_start,
+        (void**)&summary->ref_start,
+        (void**)&summary->blocks.items,
+        (void**)&summary->refs.items,
+        (void**)&summary->parent_map,
+    };
+    size_t offset = head;
+    for (size_t p = 0; p < sizeof(sizes) / sizeof(sizes[0]); ++p) {
+        *fields[p] = malloc(sizes[p] ? sizes[p] : 1);
+        memcpy(*fields[p], data + offset, sizes[p]);
+        offset += sizes[p];
+    }
+    free(data);
+    summary->ngroups = counts[0];
+    summary->blocks.count = summary->blocks.capacity = counts[1];
+    summary->refs.count = summary->refs.capacity = counts[2];
+    if (summary->block_start[counts[0]] != counts[1] || summary->ref_start[counts[0]] != counts[2]) {
+        summary_free(summary);
+        return 0;
+    }
+    return 1;
 }
 
 int main(int argc, char* argv[]) {
-    FILE* image = fopen(argv[1], "rb");
-    if (image == NULL) {
+    // fscheck [-j threads] [-r json|csv] [-m MiB] [-s] [-i] [-a] [--repair] image
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t memory = 0;
+    struct report report;
+    memset(&report, 0, sizeof(report));
+    int json = 0;
+    int output = 0;
+    int repair = 0;
+    int stats = 0;
+    int incremental = 0;
+    int analyze = 0;
+    struct bitmap_stats usage;
+    const struct option long_options[] = {
+        {"repair", no_argument, NULL, 'R'},
+        {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:r:m:sia", long_options, NULL)) != -1) {
+        if (opt == 'R') {
+            repair = 1;
+        } else if (opt == 's') {
+            stats = 1;
+        } else if (opt == 'i') {
+            incremental = 1;
+        } else if (opt == 'a') {
+            analyze = 1;
+        } else if (opt == 'j') {
+            nthreads = atoi(optarg);
+        } else if (opt == 'm' && atol(optarg) > 0) {
+            memory = (size_t)atol(optarg) << 20;
+        } else if (opt == 'r' && (strcmp(optarg, "json") == 0 || strcmp(optarg, "csv") == 0)) {
+            output = 1;
+            json = (strcmp(optarg, "json") == 0);
+        } else {
+            fprintf(stderr, "usage: %s [-j threads] [-r json|csv] [-m MiB] [-s] [-i] "
+                "[-a] [--repair] image\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+    // Repair needs every problem, not just the first
+    report.all = output || repair;
+    int fd = optind < argc ? open(argv[optind], repair ? O_RDWR : O_RDONLY) : -1;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
         fprintf(stderr, "%s\n", IMAGE_NOT_FOUND);
         exit(1);
     }
 
-    uchar buffer[BSIZE];
+    // Finish a repair that was cut short before checking
+    char journal[4096];
+    if (repair) {
+        snprintf(journal, sizeof(journal), "%s.journal", argv[optind]);
+        int replayed = journal_replay(fd, journal, st.st_size / BSIZE);
+        if (replayed < 0) {
+            fprintf(stderr, "repair: replaying %s failed.\n", journal);
+            exit(1);
+        }
+        if (replayed > 0)
+            printf("replayed %d blocks from %s\n", replayed, journal);
+    }
+    uint image_blks = st.st_size / BSIZE;
+    if (image_blks < 2) {
+        fprintf(stderr, "%s\n", ERR_IMAGE_SIZE);
+        exit(1);
+    }
 
-    // Skip Empty Block
-    fseek(image, BSIZE, SEEK_CUR);
+    // Map Image - everything below is read in place
+    uchar* image = mmap(NULL, (size_t)image_blks * BSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "%s\n", IMAGE_NOT_FOUND);
+        exit(1);
+    }
+    if (!repair)
+        close(fd);
 
-    // Read Superblock
+    // Superblock
     struct superblock super_blk;
-    fread(buffer, 1, BSIZE, image);
-    memcpy(&super_blk, buffer, sizeof(struct superblock));
+    memcpy(&super_blk, get_block(image, 1), sizeof(struct superblock));
 
-    // Read Inode Table
+    // Inode Table
     uint inode_blks = (super_blk.ninodes + IPB - 1) / IPB;
-    struct dinode inode_tbl[inode_blks * IPB];
-    for (uint i = 0; i < inode_blks; ++i) {
-        fread(buffer, 1, BSIZE, image);
-        memcpy(&inode_tbl[IPB * i], buffer, BSIZE);
-    }
+    struct dinode* inode_tbl = get_block(image, 2);
 
-    // Skip Empty Block
-    fseek(image, BSIZE, SEEK_CUR);
-
-    // Read Data Bitmap
+    // Data Bitmap, after the empty block that follows the inode table
     uint bitmap_blks = (super_blk.size + BPB - 1) / BPB;
-    uchar bitmap[bitmap_blks * BSIZE];
-    for (uint i = 0; i < bitmap_blks; ++i) {
-        fread(buffer, 1, BSIZE, image);
-        memcpy(bitmap, buffer, BSIZE);
+    uchar* bitmap = get_block(image, inode_blks + 3);
+
+    if (super_blk.size > image_blks || (size_t)inode_blks + bitmap_blks + 3 > image_blks) {
+        fprintf(stderr, "%s\n", ERR_IMAGE_SIZE);
+        exit(1);
     }
 
 #ifdef DEBUG
@@ -108,25 +1764,19 @@ int main(int argc, char* argv[]) {
             printf("[%d]\n", i);
             for (uint j = 0; j < NDIRECT; ++j) {
                 if (inode_tbl[i].addrs[j] != 0) {
-                    fseek(image, inode_tbl[i].addrs[j] * BSIZE, SEEK_SET);
-                    fread(buffer, 1, BSIZE, image);
-                    for (struct dirent* dir = (struct dirent*)buffer;
-                        dir < (struct dirent*)(buffer + BSIZE); ++dir) {
+                    struct dirent* dirent = get_block(image, inode_tbl[i].addrs[j]);
+                    for (struct dirent* dir = dirent; dir < dirent + DPB; ++dir) {
                         if (dir->inum != 0)
                             printf("%s: %d\n", dir->name, dir->inum);
                     }
                 }
             }
             if (inode_tbl[i].addrs[NDIRECT] != 0) {
-                uint indirect_blk[NINDIRECT];
-                fseek(image, inode_tbl[i].addrs[NDIRECT] * BSIZE, SEEK_SET);
-                fread(indirect_blk, 1, BSIZE, image);
+                uint* indirect_blk = get_block(image, inode_tbl[i].addrs[NDIRECT]);
                 for (uint j = 0; j < NINDIRECT; ++j) {
                     if (indirect_blk[j] != 0) {
-                        fseek(image, indirect_blk[j] * BSIZE, SEEK_SET);
-                        fread(buffer, 1, BSIZE, image);
-                        for (struct dirent* dir = (struct dirent*)buffer;
-                            dir < (struct dirent*)(buffer + BSIZE); ++dir) {
+                        struct dirent* dirent = get_block(image, indirect_blk[j]);
+                        for (struct dirent* dir = dirent; dir < dirent + DPB; ++dir) {
                             if (dir->inum != 0)
                                 printf("%s: %d\n", dir->name, dir->inum);
                         }
@@ -137,9 +1787,50 @@ int main(int argc, char* argv[]) {
     }
 #endif
 
+    struct scan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.image = image;
+    scan.super_blk = super_blk;
+    scan.inode_tbl = inode_tbl;
+    scan.data_region = bitmap_blks + inode_blks + 3;
+    scan.bitmap = bitmap;
+    scan.report = &report;
+    pthread_mutex_init(&report.mutex, NULL);
+    if (!report.all)
+        report.problems = calloc(1, sizeof(struct problem));
+    report.stop_inode = super_blk.ninodes;
+
+    // Streaming Check, single-threaded, if the tables below would not fit
+    // in the given memory
+    size_t tables = (size_t)bitmap_blks * BSIZE + (size_t)super_blk.size * sizeof(uint)
+        + (size_t)super_blk.ninodes * sizeof(ushort) * 3 * (nthreads + 1);
+    if (memory != 0 && tables > memory) {
+        if (repair) {
+            fprintf(stderr, "repair: image needs more than -m allows.\n");
+            exit(1);
+        }
+        stream_check(&scan, memory);
+        if (stats) {
+            bitmap_stats(bitmap, scan.data_region, super_blk.size, &usage);
+            print_stats(&usage);
+            print_file_stats(inode_tbl, super_blk.ninodes);
+        }
+        if (analyze) {
+            struct layout layout;
+            analyze_layout(&scan, &layout);
+            print_layout(&layout);
+        }
+        int status = (report.count > 0);
+        if (output)
+            report_print(&report, json);
+        free(report.problems);
+        pthread_mutex_destroy(&report.mutex);
+        munmap(image, (size_t)image_blks * BSIZE);
+        return status;
+    }
+
     // Initialize Reconstructed Data Bitmap
-    uchar bitmap_rec[bitmap_blks * BSIZE];
-    memset(bitmap_rec, 0, sizeof(bitmap_rec));
+    uchar* bitmap_rec = calloc(bitmap_blks, BSIZE);
     set_bit(bitmap_rec, 0);
     set_bit(bitmap_rec, 1);
     for (uint i = 0; i < inode_blks; ++i) {
@@ -149,146 +1840,163 @@ int main(int argc, char* argv[]) {
     for (uint i = 0; i < bitmap_blks; ++i) {
         set_bit(bitmap_rec, i + inode_blks + 3);
     }
-    uint data_region = bitmap_blks + inode_blks + 3;
 
     // Initialize Directory-Related Data Structures
-    ushort ref_count[super_blk.ninodes];
-    memset(ref_count, 0, sizeof(ref_count));
-    ref_count[1] = 1; 
-    ushort parent_map[super_blk.ninodes];
-    memset(parent_map, 0, sizeof(parent_map));
-    ushort child_map[super_blk.ninodes];
-    memset(child_map, 0, sizeof(child_map));
+    ushort* ref_count = calloc(super_blk.ninodes, sizeof(ushort));
+    ref_count[1] = 1;
+    ushort* parent_map = calloc(super_blk.ninodes, sizeof(ushort));
+    ushort* child_map = calloc(super_blk.ninodes, sizeof(ushort));
     child_map[1] = 1;
 
-    // Enumerate Inodes - First Pass
-    for (uint i = 0; i < super_blk.ninodes; ++i) {
-        if (inode_tbl[i].type == 0) {
-            continue;
-        } else if (inode_tbl[i].type > T_DEV) {
-            fprintf(stderr, "%s\n", ERR_INODE);
-            exit(1);
-        } else {
-            if (i == 1 && inode_tbl[i].type != T_DIR) {
-                fprintf(stderr, "%s\n", ERR_DIR_ROOT);
-                exit(1);
-            }
-            for (uint j = 0; j < NDIRECT; ++j) {
-                if (inode_tbl[i].addrs[j] == 0) {
-                    // break;
-                } else if (inode_tbl[i].addrs[j] > super_blk.size
-                    || inode_tbl[i].addrs[j] < data_region) {
-                    fprintf(stderr, "%s\n", ERR_ADDR_BND);
-                    exit(1);
-                } else if (test_and_set_bit(bitmap_rec, inode_tbl[i].addrs[j]) != 0) {
-                    fprintf(stderr, "%s\n", ERR_ADDR_DUP);
-                    exit(1);
-                } else if (inode_tbl[i].type == T_DIR) {
-                    fseek(image, inode_tbl[i].addrs[j] * BSIZE, SEEK_SET);
-                    fread(buffer, 1, BSIZE, image);
-                    struct dirent* dirent = (struct dirent*)buffer;
-                    uint k = 0;
-                    if (j == 0) {
-                        if (strcmp(dirent[0].name, ".") != 0 || strcmp(dirent[1].name, "..") != 0) {
-                            fprintf(stderr, "%s\n", ERR_DIR_FMT);
-                            exit(1);
-                        }
-                        if (i == 1 && dirent[1].inum != 1) {
-                            fprintf(stderr, "%s\n", ERR_DIR_ROOT);
-                            exit(1);
-                        }
-                        parent_map[i] = dirent[1].inum;
-                        k = 2;
-                    }
-                    for (; k < DPB; ++k) {
-                        if (dirent[k].inum != 0) {
-                            ref_count[dirent[k].inum] += 1;
-                            child_map[dirent[k].inum] = i;
-                        }
-                    }
-                }
-            }
-            if (inode_tbl[i].addrs[NDIRECT] == 0) {
-            } else if (inode_tbl[i].addrs[NDIRECT] > super_blk.size
-                || inode_tbl[i].addrs[NDIRECT] < data_region) {
-                fprintf(stderr, "%s\n", ERR_ADDR_BND);
-                exit(1);
-            } else if (test_and_set_bit(bitmap_rec, inode_tbl[i].addrs[NDIRECT]) != 0) {
-                fprintf(stderr, "%s\n", ERR_ADDR_DUP);
-                exit(1);
-            } else {
-                uint indirect_blk[NINDIRECT];
-                fseek(image, inode_tbl[i].addrs[NDIRECT] * BSIZE, SEEK_SET);
-                fread(indirect_blk, 1, BSIZE, image);
-                for (uint j = 0; j < NINDIRECT; ++j) {
-                    if (indirect_blk[j] == 0) {
-                        break;
-                    } else if (indirect_blk[j] > super_blk.size
-                        || indirect_blk[j] < data_region) {
-                        fprintf(stderr, "%s\n", ERR_ADDR_BND);
-                        exit(1);
-                    } else if (test_and_set_bit(bitmap_rec, indirect_blk[j]) != 0) {
-                        fprintf(stderr, "%s\n", ERR_ADDR_DUP);
-                        exit(1);
-                    } else if (inode_tbl[i].type == T_DIR) {
-                        fseek(image, inode_tbl[i].addrs[j] * BSIZE, SEEK_SET);
-                        fread(buffer, 1, BSIZE, image);
-                        struct dirent* dirent = (struct dirent*)buffer;
-                        for (uint k = 0; k < DPB; ++k) {
-                            if (dirent[k].inum != 0) {
-                                ref_count[dirent[k].inum] += 1;
-                                child_map[dirent[k].inum] = i;
-                            }
-                        }
-                    }
-                }
-            }
-        }   
+    // Incremental Check - unchanged inode groups come from the summary
+    scan.bitmap_rec = bitmap_rec;
+    scan.parent_map = parent_map;
+    struct edge_list edges;
+    memset(&edges, 0, sizeof(edges));
+    char summary_path[4096];
+    struct summary old, cur;
+    memset(&old, 0, sizeof(old));
+    memset(&cur, 0, sizeof(cur));
+    if (incremental) {
+        snprintf(summary_path, sizeof(summary_path), "%s.summary", argv[optind]);
+        summary_hash(&scan, &cur);
+        scan.skip = calloc(cur.ngroups, 1);
+        uint skipped = 0;
+        if (summary_load(&old, &super_blk, summary_path))
+            skipped = summary_apply(&scan, &cur, &old, ref_count, child_map, &edges);
+        if (stats)
+            printf("inode groups: %u of %u rescanned\n", cur.ngroups - skipped, cur.ngroups);
     }
 
-    // Compare Data Bitmap
-    for (uint i = 0; i < bitmap_blks * BSIZE; ++i) {
-        if (bitmap_rec[i] == bitmap[i]) {
-            continue;
-        } else if (bitmap_rec[i] > bitmap[i]) {
-            fprintf(stderr, "%s\n", ERR_DBMP_FREE);
-            exit(1);
-        } else {
-            fprintf(stderr, "%s\n", ERR_DBMP_USED);
-            exit(1);
+    // Enumerate Inodes - First Pass, after finding the first inode to use
+    // each block
+    report.stage = STAGE_SCAN;
+    if (nthreads > (super_blk.ninodes + SCAN_CHUNK - 1) / SCAN_CHUNK)
+        nthreads = (super_blk.ninodes + SCAN_CHUNK - 1) / SCAN_CHUNK;
+    if (nthreads < 1)
+        nthreads = 1;
+    scan.owner = malloc((size_t)super_blk.size * sizeof(uint));
+    memset(scan.owner, 0xff, (size_t)super_blk.size * sizeof(uint));
+    struct shard* shards = calloc(nthreads, sizeof(struct shard));
+    for (int t = 0; t < nthreads; ++t) {
+        shards[t].scan = &scan;
+        shards[t].ref_count = calloc(super_blk.ninodes, sizeof(ushort));
+        shards[t].child_map = calloc(super_blk.ninodes, sizeof(ushort));
+    }
+    int (*passes[])(struct scan*, struct shard*, uint) = {claim_direct, claim_indirect, scan_inode};
+    for (size_t p = 0; p < sizeof(passes) / sizeof(passes[0]); ++p) {
+        scan.pass = passes[p];
+        scan.next = 0;
+        for (int t = 0; t < nthreads; ++t)
+            pthread_create(&shards[t].thread, NULL, scan_worker, &shards[t]);
+        for (int t = 0; t < nthreads; ++t)
+            pthread_join(shards[t].thread, NULL);
+    }
+    free(scan.owner);
+    report_first(&report);
+
+    // Merge Shards; a sequential scan would leave the last directory
+    // referring to each inode in child_map
+    for (int t = 0; t < nthreads; ++t) {
+        for (uint i = 0; i < super_blk.ninodes; ++i) {
+            ref_count[i] += shards[t].ref_count[i];
+            if (shards[t].child_map[i] > child_map[i])
+                child_map[i] = shards[t].child_map[i];
+        }
+        for (size_t e = 0; e < shards[t].edges.count; ++e)
+            edge_add(&edges, shards[t].edges.items[e].dir, shards[t].edges.items[e].inum);
+        free(shards[t].ref_count);
+        free(shards[t].child_map);
+        free(shards[t].edges.items);
+    }
+    free(shards);
+
+    // Compare Data Bitmap, a word at a time
+    report.stage = STAGE_BITMAP;
+    int stop = 0;
+    for (size_t w = 0; w < (size_t)bitmap_blks * BSIZE / 8 && !stop; ++w) {
+        uint64_t rec = get_word(bitmap_rec, w);
+        uint64_t diff = rec ^ get_word(bitmap, w);
+        while (diff != 0 && !stop) {
+            uint bit = __builtin_ctzll(diff);
+            diff &= diff - 1;
+            stop = problem(&report, (rec >> bit) & 1 ? ERR_DBMP_FREE : ERR_DBMP_USED, -1,
+                w * 64 + bit);
         }
     }
+    if (stats)
+        bitmap_stats(bitmap, scan.data_region, super_blk.size, &usage);
+    report_first(&report);
 
     // Enumerate Inodes - Second Pass
-    for (uint i = 0; i < super_blk.ninodes; ++i) {
+    report.stage = STAGE_INODES;
+    stop = 0;
+    for (uint i = 0; i < super_blk.ninodes && !stop; ++i) {
         if (inode_tbl[i].type == 0) {
-            if (ref_count[i] > 0) {
-                fprintf(stderr, "%s\n", ERR_ITBL_FREE);
-                exit(1);
-            }
-        } else {
-            if (ref_count[i] == 0) {
-                fprintf(stderr, "%s\n", ERR_ITBL_USED);
-                exit(1);
-            }
-            if (inode_tbl[i].type == T_DIR) {
-                if (ref_count[i] > 1) {
-                    fprintf(stderr, "%s\n", ERR_DIR_REF);
-                    exit(1);
-                }
-                if (parent_map[i] != child_map[i]) {
-                    fprintf(stderr, "%s\n", ERR_DIR_PARENT);
-                    exit(1);
-                }
-            } else if (inode_tbl[i].type == T_FILE) {
-                if (inode_tbl[i].nlink != ref_count[i]) {
-                    fprintf(stderr, "%s\n", ERR_FILE_REF);
-                    exit(1);
-                }
-            }
+            if (ref_count[i] > 0)
+                stop = problem(&report, ERR_ITBL_FREE, i, -1);
+        } else if (ref_count[i] == 0) {
+            stop = problem(&report, ERR_ITBL_USED, i, -1);
+        } else if (inode_tbl[i].type == T_DIR) {
+            if (ref_count[i] > 1)
+                stop = problem(&report, ERR_DIR_REF, i, -1);
+            else if (parent_map[i] != child_map[i])
+                stop = problem(&report, ERR_DIR_PARENT, i, -1);
+        } else if (inode_tbl[i].type == T_FILE || inode_tbl[i].type == T_SMALLFILE) {
+            if (inode_tbl[i].nlink != ref_count[i])
+                stop = problem(&report, ERR_FILE_REF, i, -1);
         }
     }
 
-    fclose(image);
-    return 0;
+    // Directory Tree - every directory must be reachable from the root
+    if (!stop)
+        check_tree(&scan, &edges, ref_count);
+    free(edges.items);
+    report_first(&report);
+
+    // Save Summary, once the image is known to be clean
+    int status = (report.count > 0);
+    if (incremental) {
+        if (status == 0 && !repair) {
+            summary_build(&scan, &cur, &old);
+            summary_save(&cur, &super_blk, summary_path);
+        }
+        summary_free(&old);
+        summary_free(&cur);
+        free(scan.skip);
+    }
+
+    // Report-All Output
+    if (stats) {
+        print_stats(&usage);
+        print_file_stats(inode_tbl, super_blk.ninodes);
+    }
+    if (analyze) {
+        struct layout layout;
+        analyze_layout(&scan, &layout);
+        print_layout(&layout);
+    }
+    if (output)
+        report_print(&report, json);
+
+    // Repair
+    if (repair) {
+        struct repair r;
+        memset(&r, 0, sizeof(r));
+        r.scan = &scan;
+        r.ref_count = ref_count;
+        r.child_map = child_map;
+        r.bitmap_start = inode_blks + 3;
+        status = repair_image(&r, &report, fd, journal, bitmap_blks);
+        close(fd);
+    }
+    free(report.problems);
+    pthread_mutex_destroy(&report.mutex);
+
+    free(bitmap_rec);
+    free(ref_count);
+    free(parent_map);
+    free(child_map);
+    munmap(image, (size_t)image_blks * BSIZE);
+    return status;
 }
\ No newline at end of file
@@ -8,7 +8,10 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NBUF         10  // size of disk block cache
+#define NBUF         10  // minimum size of disk block cache
+#define BCACHEFRAC   16  // disk block cache gets 1/BCACHEFRAC of memory
+#define FLUSHTICKS  100  // ticks between write-backs of dirty buffers
+#define RAHEAD        8  // blocks read ahead of sequential reads
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
@@ -1,58 +1,168 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 // 
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to flush it to disk.
+// * After changing buffer data, call bwrite to mark it for writing.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
 // 
-// The implementation uses three state flags internally:
+// The implementation uses four state flags internally:
 // * B_BUSY: the block has been returned from bread
 //     and has not been passed back to brelse.  
 // * B_VALID: the buffer data has been initialized
 //     with the associated disk block contents.
 // * B_DIRTY: the buffer data has been modified
-//     and needs to be written to disk.
+//     and needs to be written to disk.  bwrite only sets
+//     it; the bflush process writes dirty buffers back every
+//     FLUSHTICKS, bsync (fsync) on demand, and bget before
+//     recycling a dirty buffer.
+// * B_REF: the buffer was used since the clock hand
+//     last passed it.
+//
+// Buffers are hashed by (dev, sector) into NBUCKET chains, each
+// with its own lock, which also guards the flags of the buffers
+// on the chain.  Lookups only take the bucket lock.  Misses
+// recycle a buffer chosen by a clock sweep over all buffers,
+// under bcache.lock, which is always taken before a bucket lock.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 127
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;  // chain through hnext
+};
+
+struct {
+  struct spinlock lock;  // serializes misses; guards hand
+  struct bucket bucket[NBUCKET];
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+  // Ring of all buffers, through cnext, swept by the clock hand.
+  struct buf *hand;
+  int nbuf;
 } bcache;
 
+extern char end[]; // first address after kernel loaded from ELF file
+
+static struct bucket*
+bucket(uint dev, uint sector)
+{
+  return &bcache.bucket[(dev * 31 + sector) % NBUCKET];
+}
+
+// Carve buffers out of whole pages, 1/BCACHEFRAC of the memory
+// above the kernel, but at least NBUF of them.
 void
 binit(void)
 {
-  struct buf *b;
+  struct buf *b, *page, *last;
+  int i, perpage, npages;
 
   initlock(&bcache.lock, "bcache");
+  for(i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+
+  perpage = PGSIZE / sizeof(struct buf);
+  npages = (PHYSTOP - PGROUNDUP((uint)end)) / PGSIZE / BCACHEFRAC;
+  if(npages * perpage < NBUF)
+    npages = (NBUF + perpage - 1) / perpage;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    b->dev = -1;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  last = 0;
+  for(; npages > 0; npages--){
+    if((page = (struct buf*)kalloc()) == 0)
+      break;
+    for(b = page; b < page + perpage; b++){
+      // Unmatchable identity until first use; spread over buckets.
+      b->dev = -1;
+      b->sector = bcache.nbuf++;
+      b->flags = 0;
+      b->hnext = bucket(b->dev, b->sector)->head;
+      bucket(b->dev, b->sector)->head = b;
+      b->cnext = last;
+      last = b;
+    }
   }
+  if(last == 0)
+    panic("binit: no buffers");
+  // Close the ring.
+  for(b = last; b->cnext; b = b->cnext)
+    ;
+  b->cnext = last;
+  bcache.hand = last;
+}
+
+// Pick a buffer to recycle: the first one the clock hand finds
+// neither busy nor recently used, clearing B_REF as it goes.
+// Clean buffers are preferred; a dirty one is only taken once
+// two sweeps found nothing else, and is returned B_BUSY but
+// still hashed, for the caller to write back.  Otherwise the
+// buffer is removed from its chain and returned B_BUSY.
+// Caller must hold bcache.lock.
+static struct buf*
+bvictim(void)
+{
+  struct buf *b, **pp;
+  struct bucket *bk;
+  int n;
+
+  for(n = 0; n < 3 * bcache.nbuf; n++){
+    b = bcache.hand;
+    bcache.hand = b->cnext;
+    bk = bucket(b->dev, b->sector);
+    acquire(&bk->lock);
+    if(b->flags & B_BUSY){
+      release(&bk->lock);
+      continue;
+    }
+    if(b->flags & B_REF){
+      b->flags &= ~B_REF;
+      release(&bk->lock);
+      continue;
+    }
+    if(b->flags & B_DIRTY){
+      if(n >= 2 * bcache.nbuf){
+        b->flags |= B_BUSY;
+        release(&bk->lock);
+        return b;
+      }
+      release(&bk->lock);
+      continue;
+    }
+    for(pp = &bk->head; *pp != b; pp = &(*pp)->hnext)
+      ;
+    *pp = b->hnext;
+    b->flags = B_BUSY;
+    release(&bk->lock);
+    return b;
+  }
+  panic("bget: no buffers");
+}
+
+// Clear B_BUSY on b and wake up processes waiting for it.
+// Called by the disk driver when a bread_async read is done.
+void
+bdone(struct buf *b)
+{
+  struct bucket *bk;
+
+  bk = bucket(b->dev, b->sector);
+  acquire(&bk->lock);
+  b->flags &= ~(B_BUSY|B_ASYNC);
+  wakeup(b);
+  release(&bk->lock);
 }
 
 // Look through buffer cache for sector on device dev.
@@ -62,34 +172,57 @@ static struct buf*
 bget(uint dev, uint sector)
 {
   struct buf *b;
+  struct bucket *bk;
 
-  acquire(&bcache.lock);
+  bk = bucket(dev, sector);
 
  loop:
   // Try for cached block.
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->hnext){
     if(b->dev == dev && b->sector == sector){
       if(!(b->flags & B_BUSY)){
         b->flags |= B_BUSY;
-        release(&bcache.lock);
+        release(&bk->lock);
         return b;
       }
-      sleep(b, &bcache.lock);
+      sleep(b, &bk->lock);
+      release(&bk->lock);
       goto loop;
     }
   }
+  release(&bk->lock);
 
-  // Allocate fresh block.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if((b->flags & B_BUSY) == 0){
-      b->dev = dev;
-      b->sector = sector;
-      b->flags = B_BUSY;
+  // Allocate fresh block.  Another process may have missed on
+  // the same sector and added it since we looked; misses are
+  // serialized by bcache.lock, so looking again under it is enough.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->hnext){
+    if(b->dev == dev && b->sector == sector){
+      release(&bk->lock);
       release(&bcache.lock);
-      return b;
+      goto loop;
     }
   }
-  panic("bget: no buffers");
+  release(&bk->lock);
+
+  b = bvictim();
+  if(b->flags & B_DIRTY){
+    // Write it back, then look again.
+    release(&bcache.lock);
+    iderw(b);
+    bdone(b);
+    goto loop;
+  }
+  b->dev = dev;
+  b->sector = sector;
+  acquire(&bk->lock);
+  b->hnext = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.lock);
+  return b;
 }
 
 // Return a B_BUSY buf with the contents of the indicated disk sector.
@@ -104,35 +237,139 @@ bread(uint dev, uint sector)
   return b;
 }
 
-// Write b's contents to disk.  Must be locked.
+// Start reading the indicated disk sector into the cache, if it
+// is not there, without waiting for it.  Gives up rather than
+// block: when the only buffer to recycle is dirty, nothing is
+// read.  The buffer stays B_BUSY until the disk is done, and is
+// marked used so that the clock keeps it for the reader.
+void
+bread_async(uint dev, uint sector)
+{
+  struct buf *b;
+  struct bucket *bk;
+
+  bk = bucket(dev, sector);
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->hnext)
+    if(b->dev == dev && b->sector == sector)
+      break;
+  release(&bk->lock);
+  if(b){
+    release(&bcache.lock);
+    return;
+  }
+
+  b = bvictim();
+  if(b->flags & B_DIRTY){
+    release(&bcache.lock);
+    bdone(b);
+    return;
+  }
+  b->dev = dev;
+  b->sector = sector;
+  b->flags |= B_REF;
+  acquire(&bk->lock);
+  b->hnext = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.lock);
+  ideread_async(b);
+}
+
+// Mark b's contents to be written to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if((b->flags & B_BUSY) == 0)
     panic("bwrite");
   b->flags |= B_DIRTY;
-  iderw(b);
 }
 
 // Release the buffer b.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if((b->flags & B_BUSY) == 0)
     panic("brelse");
 
-  acquire(&bcache.lock);
-
-  b->next->prev = b->prev;
-  b->prev->next = b->next;
-  b->next = bcache.head.next;
-  b->prev = &bcache.head;
-  bcache.head.next->prev = b;
-  bcache.head.next = b;
+  bk = bucket(b->dev, b->sector);
+  acquire(&bk->lock);
 
   b->flags &= ~B_BUSY;
+  b->flags |= B_REF;
   wakeup(b);
 
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
+// Write back every dirty buffer, in (dev, sector) order so the
+// disk head sweeps once.  Each round picks the lowest dirty block
+// after the last one written.  If wait is set, buffers in use are
+// waited for, as in bget, so that everything dirty when bsync was
+// called is on disk when it returns; otherwise they are skipped.
+void
+bsync(int wait)
+{
+  struct buf *b, *next;
+  struct bucket *bk;
+  uint dev, sector;
+  int n, started;
+
+  dev = sector = 0;
+  started = 0;
+  for(;;){
+    next = 0;
+    b = bcache.hand;
+    for(n = 0; n < bcache.nbuf; n++, b = b->cnext){
+      if(!(b->flags & B_DIRTY))
+        continue;
+      if(started && (b->dev < dev || (b->dev == dev && b->sector <= sector)))
+        continue;
+      if(next == 0 || b->dev < next->dev
+         || (b->dev == next->dev && b->sector < next->sector))
+        next = b;
+    }
+    if(next == 0)
+      return;
+    dev = next->dev;
+    sector = next->sector;
+    started = 1;
+
+    // Skip it if it was written meanwhile, or if it is in use
+    // and we are not waiting; a skipped busy buffer is caught by
+    // the next sync.
+    bk = bucket(dev, sector);
+    acquire(&bk->lock);
+    while(wait && next->dev == dev && next->sector == sector
+          && (next->flags & (B_BUSY|B_DIRTY)) == (B_BUSY|B_DIRTY))
+      sleep(next, &bk->lock);
+    if(next->dev != dev || next->sector != sector
+       || (next->flags & (B_BUSY|B_DIRTY)) != B_DIRTY){
+      release(&bk->lock);
+      continue;
+    }
+    next->flags |= B_BUSY;
+    release(&bk->lock);
+    iderw(next);
+    bdone(next);
+  }
+}
+
+// Kernel process that writes dirty buffers back every FLUSHTICKS.
+void
+bflush(void)
+{
+  uint ticks0;
+
+  for(;;){
+    acquire(&tickslock);
+    ticks0 = ticks;
+    while(ticks - ticks0 < FLUSHTICKS)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+    bsync(0);
+  }
+}
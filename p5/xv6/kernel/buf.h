@@ -5,13 +5,15 @@ struct buf {
   int flags;
   uint dev;
   uint sector;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  struct buf *hnext; // hash chain
+  struct buf *cnext; // clock ring
   struct buf *qnext; // disk queue
   uchar data[512];
 };
 #define B_BUSY  0x1  // buffer is locked by some process
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_REF   0x8  // buffer used since the clock hand last passed
+#define B_ASYNC 0x10 // read in flight for bread_async; disk releases it
 
 #endif // _BUF_H_
@@ -15,6 +15,10 @@ void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bsync(int);
+void            bread_async(uint, uint);
+void            bdone(struct buf*);
+void            bflush(void);
 
 // console.c
 void            consoleinit(void);
@@ -56,6 +60,7 @@ int             writei(struct inode*, char*, uint, uint);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            ideread_async(struct buf*);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -100,6 +105,7 @@ void            exit(void);
 int             fork(void);
 int             growproc(int);
 int             kill(int);
+void            kproc(char*, void (*)(void));
 void            pinit(void);
 void            procdump(void);
 void            scheduler(void) __attribute__((noreturn));
@@ -18,6 +18,8 @@ struct inode {
   uint inum;          // Inode number
   int ref;            // Reference count
   int flags;          // I_BUSY, I_VALID
+  uint lastbn;        // last block read, to spot sequential reads
+  uint ranext;        // first block not yet read ahead
 
   short type;         // copy of disk inode
   short major;
@@ -225,6 +225,8 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->flags = 0;
+  ip->lastbn = 0;
+  ip->ranext = 0;
   release(&icache.lock);
 
   return ip;
@@ -407,6 +409,37 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Start reading the blocks after bn if the reads of ip look
+// sequential: bn is the first block or follows the last one read.
+// Keeps up to RAHEAD blocks in flight ahead of the reader, within
+// the file.  Caller must hold ip locked.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint b, end, nblocks;
+
+  if(bn < ip->lastbn || bn > ip->lastbn + 1){
+    // Not where the last read left off, so what was read ahead
+    // says nothing about what follows bn.
+    ip->ranext = bn + 1;
+    if(bn != 0){
+      ip->lastbn = bn;
+      return;
+    }
+  }
+  ip->lastbn = bn;
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  end = bn + 1 + RAHEAD;
+  if(end > nblocks)
+    end = nblocks;
+  if(ip->ranext <= bn)
+    ip->ranext = bn + 1;
+  for(b = ip->ranext; b < end; b++)
+    bread_async(ip->dev, bmap(ip, b));
+  if(end > ip->ranext)
+    ip->ranext = end;
+}
+
 // Read data from inode.
 int
 readi(struct inode *ip, char *dst, uint off, uint n)
@@ -440,6 +473,9 @@ readi(struct inode *ip, char *dst, uint off, uint n)
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(dst, bp->data + off%BSIZE, m);
     brelse(bp);
+    // After the read it is for, which the disk queue would
+    // otherwise serve behind the read-ahead.
+    readahead(ip, off/BSIZE);
   }
   return n;
 }
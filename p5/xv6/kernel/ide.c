@@ -91,6 +91,7 @@ void
 ideintr(void)
 {
   struct buf *b;
+  int async;
 
   // Take first buffer off queue.
   acquire(&idelock);
@@ -106,6 +107,7 @@ ideintr(void)
     insl(0x1f0, b->data, 512/4);
   
   // Wake process waiting for this buf.
+  async = b->flags & B_ASYNC;
   b->flags |= B_VALID;
   b->flags &= ~B_DIRTY;
   wakeup(b);
@@ -115,6 +117,27 @@ ideintr(void)
     idestart(idequeue);
 
   release(&idelock);
+
+  // Nobody waits for an asynchronous read; release the buf.
+  if(async)
+    bdone(b);
+}
+
+// Append b to idequeue, starting the disk if it is idle.
+// Caller must hold idelock.
+static void
+ideappend(struct buf *b)
+{
+  struct buf **pp;
+
+  b->qnext = 0;
+  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)
+    ;
+  *pp = b;
+  
+  // Start disk if necessary.
+  if(idequeue == b)
+    idestart(b);
 }
 
 // Sync buf with disk. 
@@ -123,8 +146,6 @@ ideintr(void)
 void
 iderw(struct buf *b)
 {
-  struct buf **pp;
-
   if(!(b->flags & B_BUSY))
     panic("iderw: buf not busy");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
@@ -133,16 +154,7 @@ iderw(struct buf *b)
     panic("iderw: ide disk 1 not present");
 
   acquire(&idelock);
-
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)
-    ;
-  *pp = b;
-  
-  // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  ideappend(b);
   
   // Wait for request to finish.
   // Assuming will not sleep too long: ignore proc->killed.
@@ -152,3 +164,20 @@ iderw(struct buf *b)
 
   release(&idelock);
 }
+
+// Start reading buf b from disk and return without waiting.
+// b must be B_BUSY and not B_VALID; when the read is done,
+// ideintr sets B_VALID and releases b with bdone.
+void
+ideread_async(struct buf *b)
+{
+  if(!(b->flags & B_BUSY) || (b->flags & (B_VALID|B_DIRTY)))
+    panic("ideread_async");
+  if(b->dev != 0 && !havedisk1)
+    panic("iderw: ide disk 1 not present");
+
+  acquire(&idelock);
+  b->flags |= B_ASYNC;
+  ideappend(b);
+  release(&idelock);
+}
@@ -62,6 +62,7 @@ mainc(void)
   cinit();
   sti();           // enable inturrupts
   userinit();      // first user process
+  kproc("bflush", bflush); // buffer cache write-back
   scheduler();     // start running processes
 }
 
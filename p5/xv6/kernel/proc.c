@@ -101,6 +101,25 @@ userinit(void)
   release(&ptable.lock);
 }
 
+// Start a kernel process running fn, which must not return.
+// It has no user memory and runs on the kernel page table.
+void
+kproc(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kproc");
+  if((p->pgdir = setupkvm()) == 0)
+    panic("kproc: out of memory?");
+  // forkret returns to fn instead of trapret.
+  *(uint*)(p->context + 1) = (uint)fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+  acquire(&ptable.lock);
+  p->state = RUNNABLE;
+  release(&ptable.lock);
+}
+
 // Grow current process's memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -106,6 +106,19 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+// Write fd's data to disk.  The cache does not track which
+// blocks belong to which file, so all dirty blocks are written.
+int
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  bsync(1);
+  return 0;
+}
+
 // Create the path new as a link to the same inode as old.
 int
 sys_link(void)